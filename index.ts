@@ -10,7 +10,7 @@ import type { OpenClawPluginApi } from "openclaw/plugin-sdk";
 import * as lancedb from "@lancedb/lancedb";
 import { Type } from "@sinclair/typebox";
 import { randomUUID } from "node:crypto";
-import { spawn } from "node:child_process";
+import { type ChildProcessWithoutNullStreams, spawn } from "node:child_process";
 import { dirname, join } from "node:path";
 import { fileURLToPath } from "node:url";
 import { stringEnum } from "openclaw/plugin-sdk";
@@ -45,15 +45,35 @@ type MemorySearchResult = {
 
 const __dirname = dirname(fileURLToPath(import.meta.url));
 
+type PendingEmbed = {
+  resolve: (embedding: number[]) => void;
+  reject: (err: Error) => void;
+};
+
+/**
+ * Talks to a long-lived `arctic_embed_libtorch --serve` process over
+ * newline-delimited JSON, so the vocab + TorchScript model are loaded once
+ * instead of on every embed() call.
+ */
 class ArcticEmbeddings {
   private binaryPath: string;
   private modelPath: string;
+  private cachePath: string;
+  private child: ChildProcessWithoutNullStreams | null = null;
+  private pending = new Map<number, PendingEmbed>();
+  private nextId = 1;
+  private stdoutBuffer = "";
+  private stderrTail = "";
 
   constructor() {
     this.binaryPath = join(__dirname, "bin", "arctic_embed_libtorch");
     this.modelPath = join(__dirname, "arctic_model_mps.pt");
+    // Shared by every agent process on this host
+    this.cachePath = join(__dirname, "bin", "embedding-cache.bin");
   }
 
+  // Kept from the argv-based protocol so vectors stay comparable with
+  // memories stored before the server mode existed.
   private sanitizeText(text: string): string {
     return text
       .replace(/"/g, '\\"')
@@ -66,64 +86,118 @@ class ArcticEmbeddings {
       .replace(/[\n\r]/g, " ");
   }
 
-  async embed(text: string): Promise<number[]> {
-    const sanitized = this.sanitizeText(text);
+  private ensureServer(): ChildProcessWithoutNullStreams {
+    if (this.child) {
+      return this.child;
+    }
 
-    return new Promise((resolve, reject) => {
-      const child = spawn(this.binaryPath, [this.modelPath, sanitized, "--json"], {
-        stdio: ["pipe", "pipe", "pipe"],
-        shell: false,
-        env: {
-          ...process.env,
-          PYTORCH_ENABLE_MPS_FALLBACK: "1",
-        },
-      });
+    const child = spawn(this.binaryPath, [
+      this.modelPath,
+      "--serve",
+      "--cache-mb",
+      "64",
+      "--disk-cache",
+      this.cachePath,
+    ], {
+      stdio: ["pipe", "pipe", "pipe"],
+      shell: false,
+      env: {
+        ...process.env,
+        PYTORCH_ENABLE_MPS_FALLBACK: "1",
+      },
+    });
 
-      let stdout = "";
-      let stderr = "";
+    child.stdout.setEncoding("utf8");
+    child.stdout.on("data", (data: string) => {
+      this.stdoutBuffer += data;
+      let newline: number;
+      while ((newline = this.stdoutBuffer.indexOf("\n")) >= 0) {
+        const line = this.stdoutBuffer.slice(0, newline);
+        this.stdoutBuffer = this.stdoutBuffer.slice(newline + 1);
+        this.handleResponse(line);
+      }
+    });
+    child.stderr.on("data", (data: Buffer) => {
+      this.stderrTail = (this.stderrTail + data.toString()).slice(-2048);
+    });
 
-      child.stdout.on("data", (data: Buffer) => {
-        stdout += data.toString();
-      });
-      child.stderr.on("data", (data: Buffer) => {
-        stderr += data.toString();
-      });
+    const onExit = (reason: string) => {
+      if (this.child !== child) {
+        return;
+      }
+      this.child = null;
+      this.stdoutBuffer = "";
+      const err = new Error(`arctic_embed ${reason}: ${this.stderrTail}`);
+      for (const pending of this.pending.values()) {
+        pending.reject(err);
+      }
+      this.pending.clear();
+    };
+    // EPIPE after the child died is reported through "close" instead
+    child.stdin.on("error", () => {});
+    child.on("error", (err) => onExit(`failed: ${err.message}`));
+    child.on("close", (code) => onExit(`exited with code ${code}`));
 
-      child.on("close", (code) => {
-        if (code !== 0) {
-          reject(new Error(`arctic_embed exited with code ${code}: ${stderr}`));
-          return;
-        }
+    this.child = child;
+    return child;
+  }
 
-        try {
-          // Parse JSON array from stdout
-          const match = stdout.match(/\[[\s\S]*?\]/);
-          if (!match) {
-            reject(new Error("No embedding array in output"));
-            return;
-          }
+  private handleResponse(line: string): void {
+    if (!line.trim()) {
+      return;
+    }
 
-          const embedding: number[] = JSON.parse(match[0]);
-          if (!Array.isArray(embedding) || embedding.length === 0) {
-            reject(new Error("Empty embedding"));
-            return;
-          }
+    let msg: { id?: number; embedding?: unknown; error?: string };
+    try {
+      msg = JSON.parse(line);
+    } catch {
+      return;
+    }
 
-          // Normalize to VECTOR_DIM dimensions
-          if (embedding.length > VECTOR_DIM) {
-            resolve(embedding.slice(0, VECTOR_DIM));
-          } else if (embedding.length < VECTOR_DIM) {
-            const padded = [...embedding, ...Array(VECTOR_DIM - embedding.length).fill(0)];
-            resolve(padded);
-          } else {
-            resolve(embedding);
-          }
-        } catch (err) {
-          reject(new Error(`Failed to parse embedding: ${err}`));
-        }
-      });
+    const pending = msg.id !== undefined ? this.pending.get(msg.id) : undefined;
+    if (!pending) {
+      return;
+    }
+    this.pending.delete(msg.id!);
+
+    if (msg.error) {
+      pending.reject(new Error(`arctic_embed: ${msg.error}`));
+      return;
+    }
+
+    const embedding = msg.embedding;
+    if (!Array.isArray(embedding) || embedding.length === 0) {
+      pending.reject(new Error("Empty embedding"));
+      return;
+    }
+
+    // Normalize to VECTOR_DIM dimensions
+    if (embedding.length > VECTOR_DIM) {
+      pending.resolve(embedding.slice(0, VECTOR_DIM));
+    } else if (embedding.length < VECTOR_DIM) {
+      pending.resolve([...embedding, ...Array(VECTOR_DIM - embedding.length).fill(0)]);
+    } else {
+      pending.resolve(embedding);
+    }
+  }
+
+  async embed(text: string): Promise<number[]> {
+    const sanitized = this.sanitizeText(text);
+    const child = this.ensureServer();
+    const id = this.nextId++;
+
+    return new Promise((resolve, reject) => {
+      this.pending.set(id, { resolve, reject });
+      child.stdin.write(`${JSON.stringify({ id, text: sanitized })}\n`);
     });
   }
+
+  close(): void {
+    if (this.child) {
+      this.child.stdin.end();
+      this.child = null;
+    }
+  }
 }
 
 // ============================================================================
@@ -638,6 +712,7 @@ const memoryPlugin = {
         );
       },
       stop: () => {
+        embeddings.close();
         api.logger.info("memory-arctic: stopped");
       },
     });
@@ -0,0 +1,107 @@
+"""
+Export Snowflake-Arctic-Embed-Tiny to TorchScript for bin/arctic_embed_libtorch.
+
+    python scripts/export_model.py                      # fp32 -> arctic_model_mps.pt
+    python scripts/export_model.py --precision int8     # dynamic int8 -> arctic_model_int8.pt
+    python scripts/export_model.py --fused              # pooled output -> arctic_model_fused.pt
+
+The traced module takes (input_ids, attention_mask) as int64 [B, L] and
+returns {"last_hidden_state": [B, L, 384]}, which is what the C++ engine
+pools. With --fused it returns the masked-mean pooled, L2-normalized
+[B, 384] tensor instead (pooling in fp32 even when the engine runs the
+encoder in bf16/fp16), so the engine skips the dict lookup and its own
+pooling ops; it detects the format from the forward schema.
+
+int8 applies dynamic quantization to every nn.Linear (weights int8,
+activations quantized on the fly) with fbgemm on x86 and qnnpack on ARM;
+the C++ side must select the same engine (it does for --precision int8).
+"""
+
+import argparse
+import os
+import platform
+
+import torch
+from transformers import AutoModel
+
+MODEL_ID = "Snowflake/snowflake-arctic-embed-xs"
+PROJECT_ROOT = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+DEFAULT_OUTPUT = {
+    "fp32": "arctic_model_mps.pt",
+    "int8": "arctic_model_int8.pt",
+}
+
+
+class LastHiddenState(torch.nn.Module):
+    def __init__(self, encoder):
+        super().__init__()
+        self.encoder = encoder
+
+    def forward(self, input_ids, attention_mask):
+        out = self.encoder(input_ids=input_ids, attention_mask=attention_mask)
+        return {"last_hidden_state": out.last_hidden_state}
+
+
+class PooledEmbedding(torch.nn.Module):
+    """Same math as ArcticEmbedLibTorch::forwardBatch: masked mean + row-wise L2."""
+
+    def __init__(self, encoder):
+        super().__init__()
+        self.encoder = encoder
+
+    def forward(self, input_ids, attention_mask):
+        hidden = self.encoder(input_ids=input_ids, attention_mask=attention_mask).last_hidden_state.float()
+        mask = attention_mask.unsqueeze(-1).to(hidden.dtype)
+        pooled = (hidden * mask).sum(1) / mask.sum(1).clamp_min(1e-9)
+        return pooled / pooled.norm(p=2, dim=1, keepdim=True).clamp_min(1e-12)
+
+
+def quantized_engine():
+    machine = platform.machine().lower()
+    return "qnnpack" if machine in ("arm64", "aarch64") else "fbgemm"
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__, formatter_class=argparse.RawDescriptionHelpFormatter)
+    parser.add_argument("--precision", choices=sorted(DEFAULT_OUTPUT), default="fp32")
+    parser.add_argument("--device", choices=["cpu", "mps"], default=None,
+                        help="trace device (default: mps for fp32 when available, cpu otherwise)")
+    parser.add_argument("--fused", action="store_true",
+                        help="return the pooled, normalized [B, 384] embedding instead of last_hidden_state")
+    parser.add_argument("--output", default=None)
+    args = parser.parse_args()
+
+    default_name = DEFAULT_OUTPUT[args.precision]
+    if args.fused:
+        # arctic_model_fused.pt / arctic_model_fused_int8.pt: the engine's
+        # --precision int8 lookup maps the former to the latter
+        default_name = "arctic_model_fused_int8.pt" if args.precision == "int8" else "arctic_model_fused.pt"
+    output = args.output or os.path.join(PROJECT_ROOT, default_name)
+    device = args.device
+    if device is None:
+        device = "mps" if args.precision == "fp32" and torch.backends.mps.is_available() else "cpu"
+    if args.precision == "int8" and device != "cpu":
+        parser.error("int8 dynamic quantization runs on CPU only")
+
+    encoder = AutoModel.from_pretrained(MODEL_ID, torchscript=False).eval()
+    model = (PooledEmbedding(encoder) if args.fused else LastHiddenState(encoder)).eval()
+
+    if args.precision == "int8":
+        torch.backends.quantized.engine = quantized_engine()
+        model = torch.ao.quantization.quantize_dynamic(model, {torch.nn.Linear}, dtype=torch.qint8)
+
+    model = model.to(device)
+    example_ids = torch.tensor([[101, 2023, 2003, 1037, 3231, 102]], dtype=torch.long, device=device)
+    example_mask = torch.ones_like(example_ids)
+
+    with torch.no_grad():
+        traced = torch.jit.trace(model, (example_ids, example_mask), strict=False)
+    traced.save(output)
+
+    size_mb = os.path.getsize(output) / (1024 * 1024)
+    kind = "fused " if args.fused else ""
+    print(f"Saved {kind}{args.precision} TorchScript ({device}) -> {output} ({size_mb:.1f} MB)")
+
+
+if __name__ == "__main__":
+    main()
@@ -1,8 +1,11 @@
 // Arctic Embed Tiny - LibTorch Implementation
 // Uses PyTorch C++ API with MPS GPU acceleration
-// Modes: --json (output embedding as JSON array), default (benchmark)
+// Modes: --json (output embedding as JSON array), --serve (NDJSON over stdin/stdout),
+//        --listen <socket> (binary protocol over a Unix socket), default (benchmark)
 #include <torch/torch.h>
 #include <torch/script.h>
+#include <ATen/autocast_mode.h>
+#include <ATen/cpu/Utils.h>
 #include <iostream>
 #include <vector>
 #include <string>
@@ -13,199 +16,4651 @@
 #include <algorithm>
 #include <sstream>
 #include <iomanip>
+#include <stdexcept>
+#include <cstdlib>
+#include <cstdio>
+#include <functional>
+#include <deque>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <atomic>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cmath>
+#include <cctype>
+#include <iterator>
+#include <csignal>
+#include <charconv>
+#include <random>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+// ============================================================================
+// Text Scanning (SIMD character classification + ASCII lowercasing)
+// ============================================================================
+
+// Byte classes via two 16-entry nibble tables: class = lo[c & 0xF] & hi[c >> 4].
+// Each bit names a (high nibble, low nibble range) cell of the ASCII table, so
+// one pshufb/tbl per nibble classifies 16-32 bytes at once. Bytes >= 0x80 have
+// an all-zero high row and fall through as word characters.
+//   whitespace/control: 0x00-0x20, 0x7F
+//   punctuation:        ! - /   : - @   [ - `   { - ~
+static constexpr uint8_t kClassWs = 0x83;
+static constexpr uint8_t kClassPunct = 0x7C;
+alignas(16) static const uint8_t kScanLoLut[16] = {
+    0x13, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05, 0x05,
+    0x05, 0x05, 0x0D, 0x6D, 0x6D, 0x6D, 0x6D, 0xAD,
+};
+alignas(16) static const uint8_t kScanHiLut[16] = {
+    0x01, 0x01, 0x06, 0x08, 0x10, 0x20, 0x10, 0xC0,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+// Lowercases `n` bytes of `src` into `dst` and sets bit i of ws[i / 64] /
+// punct[i / 64] for whitespace/control and punctuation bytes. Mask words are
+// fully overwritten; bits past `n` in the last word are unspecified.
+using ScanTextFn = void (*)(const char* src, size_t n, char* dst, uint64_t* ws, uint64_t* punct);
+
+static void scanTextScalar(const char* src, size_t n, char* dst, uint64_t* ws, uint64_t* punct) {
+    for (size_t w = 0; w < (n + 63) / 64; ++w) {
+        ws[w] = 0;
+        punct[w] = 0;
+    }
+    for (size_t i = 0; i < n; ++i) {
+        uint8_t c = static_cast<uint8_t>(src[i]);
+        uint8_t cls = kScanLoLut[c & 0x0F] & kScanHiLut[c >> 4];
+        ws[i / 64] |= uint64_t((cls & kClassWs) != 0) << (i % 64);
+        punct[i / 64] |= uint64_t((cls & kClassPunct) != 0) << (i % 64);
+        dst[i] = static_cast<char>(static_cast<uint8_t>(c - 'A') < 26 ? c | 0x20 : c);
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void scanTextAvx2(const char* src, size_t n, char* dst, uint64_t* ws, uint64_t* punct) {
+    const __m256i lo_lut = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(kScanLoLut)));
+    const __m256i hi_lut = _mm256_broadcastsi128_si256(_mm_load_si128(reinterpret_cast<const __m128i*>(kScanHiLut)));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i ws_bits = _mm256_set1_epi8(static_cast<char>(kClassWs));
+    const __m256i punct_bits = _mm256_set1_epi8(static_cast<char>(kClassPunct));
+    const __m256i zero = _mm256_setzero_si256();
+    // Unsigned (c - 'A') < 26 as a signed compare after biasing by 0x80
+    const __m256i upper_bias = _mm256_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const __m256i upper_limit = _mm256_set1_epi8(static_cast<char>(-128 + 26));
+    const __m256i case_bit = _mm256_set1_epi8(0x20);
+
+    size_t blocks = n / 64;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint64_t ws_mask = 0;
+        uint64_t punct_mask = 0;
+        for (int half = 0; half < 2; ++half) {
+            size_t off = b * 64 + half * 32;
+            __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + off));
+            __m256i lo = _mm256_shuffle_epi8(lo_lut, _mm256_and_si256(v, nibble));
+            __m256i hi = _mm256_shuffle_epi8(hi_lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+            __m256i cls = _mm256_and_si256(lo, hi);
+            uint32_t not_ws = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(cls, ws_bits), zero)));
+            uint32_t not_punct = static_cast<uint32_t>(_mm256_movemask_epi8(
+                _mm256_cmpeq_epi8(_mm256_and_si256(cls, punct_bits), zero)));
+            ws_mask |= uint64_t(~not_ws) << (half * 32);
+            punct_mask |= uint64_t(~not_punct) << (half * 32);
+
+            __m256i upper = _mm256_cmpgt_epi8(upper_limit, _mm256_add_epi8(v, upper_bias));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + off),
+                                _mm256_or_si256(v, _mm256_and_si256(upper, case_bit)));
+        }
+        ws[b] = ws_mask;
+        punct[b] = punct_mask;
+    }
+    scanTextScalar(src + blocks * 64, n - blocks * 64, dst + blocks * 64, ws + blocks, punct + blocks);
+}
+
+__attribute__((target("ssse3")))
+static void scanTextSsse3(const char* src, size_t n, char* dst, uint64_t* ws, uint64_t* punct) {
+    const __m128i lo_lut = _mm_load_si128(reinterpret_cast<const __m128i*>(kScanLoLut));
+    const __m128i hi_lut = _mm_load_si128(reinterpret_cast<const __m128i*>(kScanHiLut));
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i ws_bits = _mm_set1_epi8(static_cast<char>(kClassWs));
+    const __m128i punct_bits = _mm_set1_epi8(static_cast<char>(kClassPunct));
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i upper_bias = _mm_set1_epi8(static_cast<char>(0x80 - 'A'));
+    const __m128i upper_limit = _mm_set1_epi8(static_cast<char>(-128 + 26));
+    const __m128i case_bit = _mm_set1_epi8(0x20);
+
+    size_t blocks = n / 64;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint64_t ws_mask = 0;
+        uint64_t punct_mask = 0;
+        for (int quarter = 0; quarter < 4; ++quarter) {
+            size_t off = b * 64 + quarter * 16;
+            __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + off));
+            __m128i lo = _mm_shuffle_epi8(lo_lut, _mm_and_si128(v, nibble));
+            __m128i hi = _mm_shuffle_epi8(hi_lut, _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+            __m128i cls = _mm_and_si128(lo, hi);
+            uint32_t not_ws = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_and_si128(cls, ws_bits), zero)));
+            uint32_t not_punct = static_cast<uint32_t>(_mm_movemask_epi8(
+                _mm_cmpeq_epi8(_mm_and_si128(cls, punct_bits), zero)));
+            ws_mask |= uint64_t(~not_ws & 0xFFFF) << (quarter * 16);
+            punct_mask |= uint64_t(~not_punct & 0xFFFF) << (quarter * 16);
+
+            __m128i upper = _mm_cmpgt_epi8(upper_limit, _mm_add_epi8(v, upper_bias));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + off),
+                             _mm_or_si128(v, _mm_and_si128(upper, case_bit)));
+        }
+        ws[b] = ws_mask;
+        punct[b] = punct_mask;
+    }
+    scanTextScalar(src + blocks * 64, n - blocks * 64, dst + blocks * 64, ws + blocks, punct + blocks);
+}
+
+#elif defined(__aarch64__)
+
+static inline uint64_t neonMovemask16(uint8x16_t m) {
+    static const uint8_t kWeights[16] = {1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128};
+    uint8x16_t t = vandq_u8(m, vld1q_u8(kWeights));
+    return uint64_t(vaddv_u8(vget_low_u8(t))) | (uint64_t(vaddv_u8(vget_high_u8(t))) << 8);
+}
+
+static void scanTextNeon(const char* src, size_t n, char* dst, uint64_t* ws, uint64_t* punct) {
+    const uint8x16_t lo_lut = vld1q_u8(kScanLoLut);
+    const uint8x16_t hi_lut = vld1q_u8(kScanHiLut);
+    const uint8x16_t nibble = vdupq_n_u8(0x0F);
+    const uint8x16_t ws_bits = vdupq_n_u8(kClassWs);
+    const uint8x16_t punct_bits = vdupq_n_u8(kClassPunct);
+    const uint8x16_t upper_a = vdupq_n_u8('A');
+    const uint8x16_t upper_span = vdupq_n_u8(26);
+    const uint8x16_t case_bit = vdupq_n_u8(0x20);
+
+    size_t blocks = n / 64;
+    for (size_t b = 0; b < blocks; ++b) {
+        uint64_t ws_mask = 0;
+        uint64_t punct_mask = 0;
+        for (int quarter = 0; quarter < 4; ++quarter) {
+            size_t off = b * 64 + quarter * 16;
+            uint8x16_t v = vld1q_u8(reinterpret_cast<const uint8_t*>(src + off));
+            uint8x16_t cls = vandq_u8(vqtbl1q_u8(lo_lut, vandq_u8(v, nibble)),
+                                      vqtbl1q_u8(hi_lut, vshrq_n_u8(v, 4)));
+            ws_mask |= neonMovemask16(vtstq_u8(cls, ws_bits)) << (quarter * 16);
+            punct_mask |= neonMovemask16(vtstq_u8(cls, punct_bits)) << (quarter * 16);
+
+            uint8x16_t upper = vcltq_u8(vsubq_u8(v, upper_a), upper_span);
+            vst1q_u8(reinterpret_cast<uint8_t*>(dst + off), vorrq_u8(v, vandq_u8(upper, case_bit)));
+        }
+        ws[b] = ws_mask;
+        punct[b] = punct_mask;
+    }
+    scanTextScalar(src + blocks * 64, n - blocks * 64, dst + blocks * 64, ws + blocks, punct + blocks);
+}
+
+#endif
+
+static ScanTextFn selectScanText() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) return scanTextAvx2;
+    if (__builtin_cpu_supports("ssse3")) return scanTextSsse3;
+#elif defined(__aarch64__)
+    return scanTextNeon;
+#endif
+    return scanTextScalar;
+}
+
+static const ScanTextFn kScanText = selectScanText();
+
+// Per-thread scratch for the scan: lowercased copy + boundary bitmasks.
+// Buffers only grow, so steady-state scanning does not allocate.
+struct TextScanBuffers {
+    std::string lower;
+    std::vector<uint64_t> ws;
+    std::vector<uint64_t> punct;
+
+    void reserve(size_t n) {
+        if (lower.size() < n) lower.resize(n);
+        size_t words = (n + 63) / 64;
+        if (ws.size() < words) {
+            ws.resize(words);
+            punct.resize(words);
+        }
+    }
+
+    static TextScanBuffers& forThread() {
+        thread_local TextScanBuffers buffers;
+        return buffers;
+    }
+};
+
+// ============================================================================
+// Pooling Kernels (SIMD masked mean + L2 normalize)
+// ============================================================================
+
+// Masked mean over L followed by row-wise L2 normalization, fused into one
+// pass over hidden [B, L, H] (fp32, contiguous). The sums of unmasked
+// positions accumulate in registers, one block of columns at a time, and are
+// written straight into the caller's out [B, H]. Each row is then scaled by
+// 1 / (count * ||mean||). A null mask means every position counts; rows with
+// no unmasked position come out as zeros, like the tensor version.
+using PoolNormalizeFn = void (*)(const float* hidden, const int64_t* mask,
+                                 size_t B, size_t L, size_t H, float* out);
+
+static inline size_t countUnmasked(const int64_t* mask, size_t L) {
+    if (!mask) return L;
+    size_t count = 0;
+    for (size_t l = 0; l < L; ++l) count += mask[l] != 0;
+    return count;
+}
+
+// Column sums for [h_begin, h_end) of one sequence, scalar
+static inline void sumColumnsScalar(const float* hidden, const int64_t* mask, size_t L, size_t H,
+                                    size_t h_begin, size_t h_end, float* acc) {
+    for (size_t h = h_begin; h < h_end; ++h) acc[h] = 0.0f;
+    for (size_t l = 0; l < L; ++l) {
+        if (mask && !mask[l]) continue;
+        const float* x = hidden + l * H;
+        for (size_t h = h_begin; h < h_end; ++h) acc[h] += x[h];
+    }
+}
+
+// sum -> sum / count / max(||sum / count||, 1e-12), in place
+static inline void normalizePooledRow(float* row, size_t H, size_t count) {
+    if (count == 0) {
+        std::fill(row, row + H, 0.0f);
+        return;
+    }
+    float sum_sq = 0.0f;
+    for (size_t h = 0; h < H; ++h) sum_sq += row[h] * row[h];
+    float mean_norm = std::sqrt(sum_sq) / static_cast<float>(count);
+    float scale = 1.0f / (static_cast<float>(count) * std::max(mean_norm, 1e-12f));
+    for (size_t h = 0; h < H; ++h) row[h] *= scale;
+}
+
+static void poolNormalizeScalar(const float* hidden, const int64_t* mask,
+                                size_t B, size_t L, size_t H, float* out) {
+    for (size_t b = 0; b < B; ++b) {
+        const int64_t* m = mask ? mask + b * L : nullptr;
+        sumColumnsScalar(hidden + b * L * H, m, L, H, 0, H, out + b * H);
+        normalizePooledRow(out + b * H, H, countUnmasked(m, L));
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void poolNormalizeAvx2(const float* hidden, const int64_t* mask,
+                              size_t B, size_t L, size_t H, float* out) {
+    constexpr size_t kRegs = 8;
+    constexpr size_t kBlock = kRegs * 8;
+    for (size_t b = 0; b < B; ++b) {
+        const int64_t* m = mask ? mask + b * L : nullptr;
+        const float* seq = hidden + b * L * H;
+        float* acc = out + b * H;
+
+        size_t h0 = 0;
+        for (; h0 + kBlock <= H; h0 += kBlock) {
+            __m256 sum[kRegs];
+            for (size_t r = 0; r < kRegs; ++r) sum[r] = _mm256_setzero_ps();
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                const float* x = seq + l * H + h0;
+                for (size_t r = 0; r < kRegs; ++r) sum[r] = _mm256_add_ps(sum[r], _mm256_loadu_ps(x + r * 8));
+            }
+            for (size_t r = 0; r < kRegs; ++r) _mm256_storeu_ps(acc + h0 + r * 8, sum[r]);
+        }
+        for (; h0 + 8 <= H; h0 += 8) {
+            __m256 sum = _mm256_setzero_ps();
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                sum = _mm256_add_ps(sum, _mm256_loadu_ps(seq + l * H + h0));
+            }
+            _mm256_storeu_ps(acc + h0, sum);
+        }
+        sumColumnsScalar(seq, m, L, H, h0, H, acc);
+        normalizePooledRow(acc, H, countUnmasked(m, L));
+    }
+}
+
+__attribute__((target("avx512f")))
+static void poolNormalizeAvx512(const float* hidden, const int64_t* mask,
+                                size_t B, size_t L, size_t H, float* out) {
+    constexpr size_t kRegs = 8;
+    constexpr size_t kBlock = kRegs * 16;
+    for (size_t b = 0; b < B; ++b) {
+        const int64_t* m = mask ? mask + b * L : nullptr;
+        const float* seq = hidden + b * L * H;
+        float* acc = out + b * H;
+
+        size_t h0 = 0;
+        for (; h0 + kBlock <= H; h0 += kBlock) {
+            __m512 sum[kRegs];
+            for (size_t r = 0; r < kRegs; ++r) sum[r] = _mm512_setzero_ps();
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                const float* x = seq + l * H + h0;
+                for (size_t r = 0; r < kRegs; ++r) sum[r] = _mm512_add_ps(sum[r], _mm512_loadu_ps(x + r * 16));
+            }
+            for (size_t r = 0; r < kRegs; ++r) _mm512_storeu_ps(acc + h0 + r * 16, sum[r]);
+        }
+        for (; h0 + 16 <= H; h0 += 16) {
+            __m512 sum = _mm512_setzero_ps();
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                sum = _mm512_add_ps(sum, _mm512_loadu_ps(seq + l * H + h0));
+            }
+            _mm512_storeu_ps(acc + h0, sum);
+        }
+        sumColumnsScalar(seq, m, L, H, h0, H, acc);
+        normalizePooledRow(acc, H, countUnmasked(m, L));
+    }
+}
+
+#elif defined(__aarch64__)
+
+static void poolNormalizeNeon(const float* hidden, const int64_t* mask,
+                              size_t B, size_t L, size_t H, float* out) {
+    constexpr size_t kRegs = 8;
+    constexpr size_t kBlock = kRegs * 4;
+    for (size_t b = 0; b < B; ++b) {
+        const int64_t* m = mask ? mask + b * L : nullptr;
+        const float* seq = hidden + b * L * H;
+        float* acc = out + b * H;
+
+        size_t h0 = 0;
+        for (; h0 + kBlock <= H; h0 += kBlock) {
+            float32x4_t sum[kRegs];
+            for (size_t r = 0; r < kRegs; ++r) sum[r] = vdupq_n_f32(0.0f);
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                const float* x = seq + l * H + h0;
+                for (size_t r = 0; r < kRegs; ++r) sum[r] = vaddq_f32(sum[r], vld1q_f32(x + r * 4));
+            }
+            for (size_t r = 0; r < kRegs; ++r) vst1q_f32(acc + h0 + r * 4, sum[r]);
+        }
+        for (; h0 + 4 <= H; h0 += 4) {
+            float32x4_t sum = vdupq_n_f32(0.0f);
+            for (size_t l = 0; l < L; ++l) {
+                if (m && !m[l]) continue;
+                sum = vaddq_f32(sum, vld1q_f32(seq + l * H + h0));
+            }
+            vst1q_f32(acc + h0, sum);
+        }
+        sumColumnsScalar(seq, m, L, H, h0, H, acc);
+        normalizePooledRow(acc, H, countUnmasked(m, L));
+    }
+}
+
+#endif
+
+struct PoolNormalizeKernel {
+    PoolNormalizeFn fn;
+    const char* name;
+};
+
+static PoolNormalizeKernel selectPoolNormalize() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f")) return {poolNormalizeAvx512, "avx512"};
+    if (__builtin_cpu_supports("avx2")) return {poolNormalizeAvx2, "avx2"};
+#elif defined(__aarch64__)
+    return {poolNormalizeNeon, "neon"};
+#endif
+    return {poolNormalizeScalar, "scalar"};
+}
+
+static const PoolNormalizeKernel kPoolNormalize = selectPoolNormalize();
+
+// ============================================================================
+// Memory-Mapped Files
+// ============================================================================
+
+// Read-only, shared mapping of a whole file. Pages come from the page cache,
+// so several engine processes mapping the same file share one copy.
+class MappedFile {
+private:
+    void* data_ = nullptr;
+    size_t size_ = 0;
+
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    ~MappedFile() {
+        if (data_) munmap(data_, size_);
+    }
+
+    bool open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        void* data = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if (data == MAP_FAILED) return false;
+
+        data_ = data;
+        size_ = static_cast<size_t>(st.st_size);
+        return true;
+    }
+
+    const uint8_t* data() const { return static_cast<const uint8_t*>(data_); }
+    size_t size() const { return size_; }
+};
 
 // ============================================================================
 // WordPiece Tokenizer
 // ============================================================================
 
+// Flattened byte trie over the vocabulary. Two roots: word-initial pieces and
+// "##" continuation pieces (stored without the "##"). Nodes and edges are
+// plain arrays so greedy longest-match is a single forward scan per piece
+// with no string building or hashing. The same arrays are the on-disk
+// layout of the compiled vocab image.
+struct TrieNode {
+    uint32_t edge_begin;   // index of first outgoing edge
+    uint32_t edge_count;
+    int32_t token_id;      // vocab id if a piece ends here, else -1
+};
+
+struct TrieEdge {
+    uint8_t byte;
+    uint8_t reserved[3];
+    uint32_t child;
+};
+
+// Compiled vocab image (--compile-vocab), host byte order:
+//   header | nodes[node_count] | edges[edge_count] | offsets[vocab_size + 1] | string pool
+// Sections are 8-byte aligned; offsets[i]..offsets[i + 1] is token i in the pool.
+struct VocabImageHeader {
+    char magic[8];           // "ARCVOCB\0"
+    uint32_t version;
+    uint32_t vocab_size;
+    uint32_t node_count;
+    uint32_t edge_count;
+    uint64_t nodes_offset;
+    uint64_t edges_offset;
+    uint64_t offsets_offset;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+};
+
+static constexpr char kVocabImageMagic[8] = {'A', 'R', 'C', 'V', 'O', 'C', 'B', '\0'};
+static constexpr uint32_t kVocabImageVersion = 1;
+static_assert(sizeof(TrieNode) == 12 && sizeof(TrieEdge) == 8 && sizeof(VocabImageHeader) == 64,
+              "vocab image layout changed; bump kVocabImageVersion");
+
+// Sliding windows for documents longer than one model input
+enum class ChunkPooling { Mean, Max };
+
+struct ChunkConfig {
+    int window_tokens = 510;    // body tokens per window ([CLS]/[SEP] come on top)
+    int overlap_tokens = 64;    // tokens shared by consecutive windows
+    ChunkPooling pooling = ChunkPooling::Mean;
+    bool return_chunks = false; // also report the per-window vectors
+    int max_windows_per_pass = 16;
+};
+
 class WordPieceTokenizer {
 private:
-    std::unordered_map<std::string, int64_t> vocab_;
+    static constexpr uint32_t kWordRoot = 0;
+    static constexpr uint32_t kSuffixRoot = 1;
+
+    // Views used by the hot path: either into the owned_* vectors (vocab.txt)
+    // or straight into the mapped image (vocab.bin)
+    const TrieNode* nodes_ = nullptr;
+    const TrieEdge* edges_ = nullptr;
+    const uint32_t* pool_offsets_ = nullptr;
+    const char* pool_ = nullptr;
+    size_t node_count_ = 0;
+    size_t edge_count_ = 0;
+    size_t vocab_size_ = 0;
+
+    std::vector<TrieNode> owned_nodes_;
+    std::vector<TrieEdge> owned_edges_;
+    std::vector<uint32_t> owned_offsets_;
+    std::string owned_pool_;
+    MappedFile image_;
+
     int64_t cls_id_ = 101;   // [CLS]
     int64_t sep_id_ = 102;   // [SEP]
     int64_t unk_id_ = 100;   // [UNK]
     int max_input_chars_ = 200;
     int max_seq_len_ = 512;
 
+    // Returns the child of `node` along `byte`, or 0 (root is never a child)
+    uint32_t trieStep(uint32_t node, uint8_t byte) const {
+        const TrieNode& n = nodes_[node];
+        const TrieEdge* lo = edges_ + n.edge_begin;
+        const TrieEdge* hi = lo + n.edge_count;
+        // Edges are sorted by byte; only the roots have long edge runs
+        while (hi - lo > 8) {
+            const TrieEdge* mid = lo + (hi - lo) / 2;
+            if (mid->byte == byte) return mid->child;
+            if (mid->byte < byte) lo = mid + 1;
+            else hi = mid;
+        }
+        for (; lo < hi; ++lo) {
+            if (lo->byte == byte) return lo->child;
+            if (lo->byte > byte) break;
+        }
+        return 0;
+    }
+
+    void buildTrie(const std::vector<std::string>& pieces) {
+        // Build with per-node child lists, then flatten into sorted edge runs
+        std::vector<std::vector<std::pair<uint8_t, uint32_t>>> children(2);
+        std::vector<int32_t> token_ids(2, -1);
+
+        for (size_t id = 0; id < pieces.size(); ++id) {
+            const std::string& piece = pieces[id];
+            bool suffix = piece.size() > 2 && piece[0] == '#' && piece[1] == '#';
+            uint32_t node = suffix ? kSuffixRoot : kWordRoot;
+            for (size_t i = suffix ? 2 : 0; i < piece.size(); ++i) {
+                uint8_t byte = static_cast<uint8_t>(piece[i]);
+                uint32_t next = 0;
+                for (const auto& edge : children[node]) {
+                    if (edge.first == byte) { next = edge.second; break; }
+                }
+                if (next == 0) {
+                    next = static_cast<uint32_t>(children.size());
+                    children[node].emplace_back(byte, next);
+                    children.emplace_back();
+                    token_ids.push_back(-1);
+                }
+                node = next;
+            }
+            // Duplicate lines: last one wins, as with the old map insert
+            token_ids[node] = static_cast<int32_t>(id);
+        }
+
+        owned_nodes_.assign(children.size(), TrieNode{0, 0, -1});
+        owned_edges_.clear();
+        for (size_t node = 0; node < children.size(); ++node) {
+            auto& edges = children[node];
+            std::sort(edges.begin(), edges.end());
+            owned_nodes_[node].edge_begin = static_cast<uint32_t>(owned_edges_.size());
+            owned_nodes_[node].edge_count = static_cast<uint32_t>(edges.size());
+            owned_nodes_[node].token_id = token_ids[node];
+            for (const auto& edge : edges) {
+                owned_edges_.push_back(TrieEdge{edge.first, {0, 0, 0}, edge.second});
+            }
+        }
+
+        owned_pool_.clear();
+        owned_offsets_.assign(1, 0);
+        for (const auto& piece : pieces) {
+            owned_pool_ += piece;
+            owned_offsets_.push_back(static_cast<uint32_t>(owned_pool_.size()));
+        }
+
+        nodes_ = owned_nodes_.data();
+        edges_ = owned_edges_.data();
+        pool_offsets_ = owned_offsets_.data();
+        pool_ = owned_pool_.data();
+        node_count_ = owned_nodes_.size();
+        edge_count_ = owned_edges_.size();
+        vocab_size_ = pieces.size();
+    }
+
+    bool loadText(const std::string& vocab_path) {
+        std::ifstream file(vocab_path);
+        if (!file.is_open()) return false;
+
+        std::vector<std::string> pieces;
+        std::string line;
+        while (std::getline(file, line)) {
+            // Strip trailing \r for Windows-style line endings
+            if (!line.empty() && line.back() == '\r') {
+                line.pop_back();
+            }
+            pieces.push_back(line);
+        }
+        if (pieces.empty()) return false;
+
+        buildTrie(pieces);
+        return true;
+    }
+
+    // Maps a compiled image; only the header is checked, nothing is parsed
+    bool loadImage(const std::string& image_path) {
+        if (!image_.open(image_path)) return false;
+        if (image_.size() < sizeof(VocabImageHeader)) return false;
+
+        VocabImageHeader header;
+        std::memcpy(&header, image_.data(), sizeof(header));
+        if (std::memcmp(header.magic, kVocabImageMagic, sizeof(header.magic)) != 0 ||
+            header.version != kVocabImageVersion || header.node_count < 2 || header.vocab_size == 0) {
+            std::cerr << "Unsupported vocab image: " << image_path << std::endl;
+            return false;
+        }
+
+        auto fits = [&](uint64_t offset, uint64_t bytes) {
+            return offset % 8 == 0 && offset <= image_.size() && bytes <= image_.size() - offset;
+        };
+        if (!fits(header.nodes_offset, uint64_t(header.node_count) * sizeof(TrieNode)) ||
+            !fits(header.edges_offset, uint64_t(header.edge_count) * sizeof(TrieEdge)) ||
+            !fits(header.offsets_offset, uint64_t(header.vocab_size + 1) * sizeof(uint32_t)) ||
+            !fits(header.pool_offset, header.pool_size)) {
+            std::cerr << "Truncated vocab image: " << image_path << std::endl;
+            return false;
+        }
+
+        const uint8_t* base = image_.data();
+        nodes_ = reinterpret_cast<const TrieNode*>(base + header.nodes_offset);
+        edges_ = reinterpret_cast<const TrieEdge*>(base + header.edges_offset);
+        pool_offsets_ = reinterpret_cast<const uint32_t*>(base + header.offsets_offset);
+        pool_ = reinterpret_cast<const char*>(base + header.pool_offset);
+        node_count_ = header.node_count;
+        edge_count_ = header.edge_count;
+        vocab_size_ = header.vocab_size;
+        return true;
+    }
+
+public:
+    WordPieceTokenizer() = default;
+    WordPieceTokenizer(const WordPieceTokenizer&) = delete;
+    WordPieceTokenizer& operator=(const WordPieceTokenizer&) = delete;
+
+    // Accepts either vocab.txt or a compiled image (detected by magic)
+    bool load(const std::string& vocab_path) {
+        char magic[sizeof(kVocabImageMagic)] = {};
+        {
+            std::ifstream probe(vocab_path, std::ios::binary);
+            if (!probe.is_open()) return false;
+            probe.read(magic, sizeof(magic));
+        }
+        if (std::memcmp(magic, kVocabImageMagic, sizeof(magic)) == 0) {
+            return loadImage(vocab_path);
+        }
+        return loadText(vocab_path);
+    }
+
+    // Writes the loaded vocab as a compiled image for loadImage()
+    bool saveImage(const std::string& image_path) const {
+        auto align8 = [](uint64_t v) { return (v + 7) & ~uint64_t(7); };
+
+        VocabImageHeader header = {};
+        std::memcpy(header.magic, kVocabImageMagic, sizeof(header.magic));
+        header.version = kVocabImageVersion;
+        header.vocab_size = static_cast<uint32_t>(vocab_size_);
+        header.node_count = static_cast<uint32_t>(node_count_);
+        header.edge_count = static_cast<uint32_t>(edge_count_);
+        header.nodes_offset = align8(sizeof(header));
+        header.edges_offset = align8(header.nodes_offset + node_count_ * sizeof(TrieNode));
+        header.offsets_offset = align8(header.edges_offset + edge_count_ * sizeof(TrieEdge));
+        header.pool_offset = align8(header.offsets_offset + (vocab_size_ + 1) * sizeof(uint32_t));
+        header.pool_size = pool_offsets_[vocab_size_];
+
+        std::ofstream out(image_path, std::ios::binary | std::ios::trunc);
+        if (!out.is_open()) return false;
+
+        auto writeAt = [&](uint64_t offset, const void* data, size_t bytes) {
+            static const char zeros[8] = {};
+            uint64_t pos = static_cast<uint64_t>(out.tellp());
+            out.write(zeros, static_cast<std::streamsize>(offset - pos));
+            out.write(static_cast<const char*>(data), static_cast<std::streamsize>(bytes));
+        };
+        writeAt(0, &header, sizeof(header));
+        writeAt(header.nodes_offset, nodes_, node_count_ * sizeof(TrieNode));
+        writeAt(header.edges_offset, edges_, edge_count_ * sizeof(TrieEdge));
+        writeAt(header.offsets_offset, pool_offsets_, (vocab_size_ + 1) * sizeof(uint32_t));
+        writeAt(header.pool_offset, pool_, header.pool_size);
+        return static_cast<bool>(out);
+    }
+
+    size_t vocabSize() const { return vocab_size_; }
+
+    std::string_view token(int64_t id) const {
+        if (id < 0 || static_cast<size_t>(id) >= vocab_size_) return {};
+        return std::string_view(pool_ + pool_offsets_[id], pool_offsets_[id + 1] - pool_offsets_[id]);
+    }
+
+    // Basic text splitting on whitespace/control + punctuation, with ASCII
+    // lowercasing. Calls visit(std::string_view word) for every word and
+    // punctuation mark in order; stops early when visit returns false. The
+    // views point into a per-thread lowercased copy and are only valid during
+    // the call. Classification runs through kScanText a chunk at a time, so
+    // text past the 512-token cut is never scanned.
+    template <typename Visitor>
+    void basicTokenize(std::string_view text, Visitor&& visit) const {
+        static constexpr size_t kChunk = 4096;   // multiple of 64
+
+        const size_t n = text.size();
+        auto& buf = TextScanBuffers::forThread();
+        buf.reserve(n);
+        const char* lower = buf.lower.data();
+
+        size_t scanned = 0;
+        size_t word_start = 0;
+        for (size_t w = 0; w * 64 < n; ++w) {
+            if (w * 64 >= scanned) {
+                size_t len = std::min(kChunk, n - scanned);
+                kScanText(text.data() + scanned, len, buf.lower.data() + scanned,
+                          buf.ws.data() + scanned / 64, buf.punct.data() + scanned / 64);
+                scanned += len;
+            }
+
+            uint64_t punct = buf.punct[w];
+            uint64_t boundary = buf.ws[w] | punct;
+            size_t valid = n - w * 64;
+            if (valid < 64) {
+                uint64_t keep = (uint64_t(1) << valid) - 1;
+                boundary &= keep;
+                punct &= keep;
+            }
+
+            // Jump from boundary to boundary; word bytes are never visited
+            while (boundary) {
+                int bit = __builtin_ctzll(boundary);
+                size_t pos = w * 64 + bit;
+                if (pos > word_start && !visit(std::string_view(lower + word_start, pos - word_start))) return;
+                if (((punct >> bit) & 1) && !visit(std::string_view(lower + pos, 1))) return;
+                word_start = pos + 1;
+                boundary &= boundary - 1;
+            }
+        }
+        if (n > word_start) {
+            visit(std::string_view(lower + word_start, n - word_start));
+        }
+    }
+
+    // WordPiece subword tokenization: greedy longest-match, appended to `out`.
+    // Each piece is one forward walk down the trie from the current position.
+    void wordPieceTokenize(std::string_view word, std::vector<int64_t>& out) const {
+        if (word.size() > static_cast<size_t>(max_input_chars_)) {
+            out.push_back(unk_id_);
+            return;
+        }
+
+        size_t start = 0;
+        while (start < word.size()) {
+            uint32_t node = start == 0 ? kWordRoot : kSuffixRoot;
+            int32_t found_id = -1;
+            size_t found_end = start;
+
+            for (size_t i = start; i < word.size(); ++i) {
+                node = trieStep(node, static_cast<uint8_t>(word[i]));
+                if (node == 0) break;
+                if (nodes_[node].token_id >= 0) {
+                    found_id = nodes_[node].token_id;
+                    found_end = i + 1;
+                }
+            }
+
+            if (found_id == -1) {
+                out.push_back(unk_id_);
+                break;
+            }
+
+            out.push_back(found_id);
+            start = found_end;
+        }
+    }
+
+    // Allocation-free tokenization: writes [CLS] ... [SEP] into `ids`, which
+    // is cleared first and keeps its capacity across calls. The attention
+    // mask is implicitly all ones.
+    void tokenizeInto(std::string_view text, std::vector<int64_t>& ids) const {
+        const size_t limit = static_cast<size_t>(max_seq_len_ - 1);
+        // Worst case before truncation: limit + one word's worth of pieces
+        ids.reserve(limit + max_input_chars_ + 1);
+        ids.clear();
+        ids.push_back(cls_id_);
+
+        basicTokenize(text, [&](std::string_view word) {
+            wordPieceTokenize(word, ids);
+            if (ids.size() >= limit) {
+                ids.resize(limit);
+                return false;
+            }
+            return true;
+        });
+
+        ids.push_back(sep_id_);
+    }
+
+    // Splits `text` into overlapping windows of at most config.window_tokens
+    // body tokens, each wrapped in [CLS] ... [SEP]. Nothing is truncated; a
+    // text that fits one window yields exactly tokenizeInto()'s ids.
+    void chunkInto(std::string_view text, const ChunkConfig& config,
+                   std::vector<std::vector<int64_t>>& windows) const {
+        thread_local std::vector<int64_t> body;
+        body.clear();
+        basicTokenize(text, [&](std::string_view word) {
+            wordPieceTokenize(word, body);
+            return true;
+        });
+
+        const size_t window = static_cast<size_t>(
+            std::clamp(config.window_tokens, 1, max_seq_len_ - 2));
+        const size_t overlap = static_cast<size_t>(
+            std::clamp(config.overlap_tokens, 0, static_cast<int>(window) - 1));
+        const size_t stride = window - overlap;
+
+        windows.clear();
+        size_t start = 0;
+        do {
+            size_t end = std::min(body.size(), start + window);
+            windows.emplace_back();
+            auto& ids = windows.back();
+            ids.reserve(end - start + 2);
+            ids.push_back(cls_id_);
+            ids.insert(ids.end(), body.begin() + start, body.begin() + end);
+            ids.push_back(sep_id_);
+            if (end == body.size()) break;
+            start += stride;
+        } while (true);
+    }
+
+    std::pair<std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::string& text) const {
+        std::vector<int64_t> input_ids;
+        tokenizeInto(text, input_ids);
+
+        std::vector<int64_t> attention_mask(input_ids.size(), 1);
+        return {input_ids, attention_mask};
+    }
+};
+
+// ============================================================================
+// Hashing
+// ============================================================================
+
+static inline uint64_t rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+// murmur3 finalizer
+static inline uint64_t mix64(uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+// Hash of a token-id sequence; `seed` carries the model identity
+static uint64_t hashTokens(const int64_t* ids, size_t n, uint64_t seed) {
+    uint64_t h = seed ^ (n * 0x9E3779B97F4A7C15ULL);
+    for (size_t i = 0; i < n; ++i) {
+        h = (rotl64(h, 23) ^ static_cast<uint64_t>(ids[i])) * 0x9E3779B97F4A7C15ULL;
+    }
+    return mix64(h);
+}
+
+static uint64_t hashBytes(const void* data, size_t n, uint64_t seed) {
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint64_t h = seed ^ (n * 0x9E3779B97F4A7C15ULL);
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint64_t word;
+        std::memcpy(&word, p + i, 8);
+        h = (rotl64(h, 23) ^ word) * 0x9E3779B97F4A7C15ULL;
+    }
+    uint64_t tail = 0;
+    std::memcpy(&tail, p + i, n - i);
+    h = (rotl64(h, 23) ^ tail) * 0x9E3779B97F4A7C15ULL;
+    return mix64(h);
+}
+
+// Cheap identity of a model file: size + mtime + the first 64 KiB. Changes
+// whenever the file is replaced, without reading all 87 MB.
+static uint64_t fingerprintFile(const std::string& path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return 0;
+
+    std::vector<char> head(64 * 1024);
+    std::ifstream file(path, std::ios::binary);
+    file.read(head.data(), static_cast<std::streamsize>(head.size()));
+    head.resize(static_cast<size_t>(file.gcount()));
+
+    uint64_t h = hashBytes(head.data(), head.size(), static_cast<uint64_t>(st.st_size));
+    return mix64(h ^ static_cast<uint64_t>(st.st_mtime));
+}
+
+// Full identity of a file's contents, for artifacts derived from it that a
+// copy preserving size and mtime (cp -p, rsync -t) must not alias. Reads the
+// whole file: ~90 MB for the fp32 model, a few tens of ms from page cache.
+static uint64_t hashFile(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return 0;
+    std::vector<char> block(1 << 20);
+    uint64_t h = 0;
+    while (file) {
+        file.read(block.data(), static_cast<std::streamsize>(block.size()));
+        size_t n = static_cast<size_t>(file.gcount());
+        if (n == 0) break;
+        h = hashBytes(block.data(), n, h);
+    }
+    return h;
+}
+
+// hashFile(path), memoized in `memo_path` ("<stamp hex> <hash hex>") so it
+// only runs when the file changes. The stamp is fingerprintFile() plus inode
+// and ctime: a copy that keeps size, mtime and leading bytes is still a new
+// inode or a new ctime, and neither can be set back by cp -p or rsync -t.
+static uint64_t memoizedFileHash(const std::string& path, const std::string& memo_path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) return 0;
+    const uint64_t stamp = mix64(fingerprintFile(path) ^ mix64(static_cast<uint64_t>(st.st_ino)) ^
+                                 (static_cast<uint64_t>(st.st_ctime) << 1) ^ static_cast<uint64_t>(st.st_dev));
+
+    unsigned long long memo_stamp = 0, memo_hash = 0;
+    if (FILE* f = std::fopen(memo_path.c_str(), "r")) {
+        int fields = std::fscanf(f, "%16llx %16llx", &memo_stamp, &memo_hash);
+        std::fclose(f);
+        if (fields == 2 && memo_stamp == stamp) return memo_hash;
+    }
+
+    const uint64_t hash = hashFile(path);
+    std::string tmp = memo_path + ".tmp." + std::to_string(getpid());
+    if (FILE* f = std::fopen(tmp.c_str(), "w")) {
+        bool ok = std::fprintf(f, "%016llx %016llx\n", static_cast<unsigned long long>(stamp),
+                               static_cast<unsigned long long>(hash)) > 0;
+        ok = std::fclose(f) == 0 && ok;
+        if (!ok || std::rename(tmp.c_str(), memo_path.c_str()) != 0) std::remove(tmp.c_str());
+    }
+    return hash;
+}
+
+// ============================================================================
+// Embedding Cache (in-process, byte-bounded, CLOCK eviction)
+// ============================================================================
+
+// Maps a token-id sequence (hashed together with the model identity) to its
+// embedding. Entries keep their ids so a hash collision is a miss, never a
+// wrong vector. Eviction is CLOCK: hits set a reference bit, the hand clears
+// bits and evicts the first unreferenced entry. Thread-safe.
+class EmbeddingCache {
+private:
+    struct Entry {
+        uint64_t key = 0;
+        std::vector<int64_t> ids;
+        std::vector<float> vector;
+        bool referenced = false;
+        bool live = false;
+    };
+
+    // Rough per-entry bookkeeping on top of the ids/vector payload
+    static constexpr size_t kEntryOverhead = sizeof(Entry) + 48;
+
+    size_t capacity_bytes_;
+    size_t bytes_ = 0;
+    std::vector<Entry> entries_;
+    std::vector<size_t> free_slots_;
+    std::unordered_map<uint64_t, size_t> index_;
+    size_t hand_ = 0;
+    uint64_t hits_ = 0;
+    uint64_t misses_ = 0;
+    uint64_t evictions_ = 0;
+    mutable std::mutex mutex_;
+
+    static size_t entryBytes(size_t num_ids, size_t dim) {
+        return num_ids * sizeof(int64_t) + dim * sizeof(float) + kEntryOverhead;
+    }
+
+    void evictOne() {
+        while (true) {
+            if (hand_ >= entries_.size()) hand_ = 0;
+            Entry& entry = entries_[hand_];
+            if (entry.live) {
+                if (entry.referenced) {
+                    entry.referenced = false;
+                } else {
+                    bytes_ -= entryBytes(entry.ids.size(), entry.vector.size());
+                    index_.erase(entry.key);
+                    entry.live = false;
+                    entry.ids = {};
+                    entry.vector = {};
+                    free_slots_.push_back(hand_);
+                    ++evictions_;
+                    ++hand_;
+                    return;
+                }
+            }
+            ++hand_;
+        }
+    }
+
+public:
+    explicit EmbeddingCache(size_t capacity_bytes) : capacity_bytes_(capacity_bytes) {}
+
+    bool lookup(uint64_t key, const std::vector<int64_t>& ids, float* out, size_t dim) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto it = index_.find(key);
+        if (it != index_.end()) {
+            Entry& entry = entries_[it->second];
+            if (entry.ids == ids && entry.vector.size() == dim) {
+                entry.referenced = true;
+                std::copy(entry.vector.begin(), entry.vector.end(), out);
+                ++hits_;
+                return true;
+            }
+        }
+        ++misses_;
+        return false;
+    }
+
+    void insert(uint64_t key, const std::vector<int64_t>& ids, const float* vector, size_t dim) {
+        size_t bytes = entryBytes(ids.size(), dim);
+        if (bytes > capacity_bytes_) return;
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        auto existing = index_.find(key);
+        if (existing != index_.end()) {
+            // Same key (or a collision): replace in place
+            Entry& entry = entries_[existing->second];
+            bytes_ -= entryBytes(entry.ids.size(), entry.vector.size());
+            entry.ids = ids;
+            entry.vector.assign(vector, vector + dim);
+            entry.referenced = true;
+            bytes_ += bytes;
+            return;
+        }
+
+        while (bytes_ + bytes > capacity_bytes_ && !index_.empty()) {
+            evictOne();
+        }
+
+        size_t slot;
+        if (!free_slots_.empty()) {
+            slot = free_slots_.back();
+            free_slots_.pop_back();
+        } else {
+            slot = entries_.size();
+            entries_.emplace_back();
+        }
+        Entry& entry = entries_[slot];
+        entry.key = key;
+        entry.ids = ids;
+        entry.vector.assign(vector, vector + dim);
+        entry.referenced = false;
+        entry.live = true;
+        index_[key] = slot;
+        bytes_ += bytes;
+    }
+
+    std::string statsJson() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t lookups = hits_ + misses_;
+        std::ostringstream os;
+        os << "{\"entries\":" << index_.size()
+           << ",\"bytes\":" << bytes_
+           << ",\"capacity_bytes\":" << capacity_bytes_
+           << ",\"hits\":" << hits_
+           << ",\"misses\":" << misses_
+           << ",\"evictions\":" << evictions_
+           << ",\"hit_rate\":" << std::setprecision(4) << (lookups ? double(hits_) / lookups : 0.0) << "}";
+        return os.str();
+    }
+
+    void printReport(std::ostream& os) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        uint64_t lookups = hits_ + misses_;
+        os << "Embedding cache: " << hits_ << " hits, " << misses_ << " misses ("
+           << std::fixed << std::setprecision(1) << (lookups ? 100.0 * hits_ / lookups : 0.0) << "% hit rate), "
+           << evictions_ << " evictions, " << index_.size() << " entries, "
+           << bytes_ / 1024 << " / " << capacity_bytes_ / 1024 << " KiB" << std::defaultfloat << std::endl;
+    }
+};
+
+// ============================================================================
+// Disk Embedding Cache (mmap, shared across processes)
+// ============================================================================
+
+// File layout: a 64-byte header followed by fixed-size slots, open addressing
+// with a short linear probe. Each slot is guarded by a sequence counter
+// (seqlock): readers never lock, they copy the slot and retry/miss if the
+// counter was odd or changed underneath them. Writers serialize on flock()
+// of the file, so any number of engine processes can share one cache file.
+struct DiskCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t dim;
+    uint64_t slot_count;
+    uint64_t slot_bytes;
+    uint64_t clock;             // insertion counter, advanced under the writer lock
+    uint64_t reserved[3];
+};
+
+struct DiskCacheSlot {
+    uint32_t seq;               // even = stable, odd = being written, 0 = never used
+    uint32_t stamp;             // low bits of header.clock at insertion (probe-window eviction)
+    uint64_t model;             // model fingerprint the vector was produced with
+    uint64_t key;               // hashTokens(ids, model)
+    uint64_t check;             // independent second hash, guards against key collisions
+    // followed by `dim` floats
+};
+
+static constexpr char kDiskCacheMagic[8] = {'A', 'R', 'C', 'E', 'M', 'B', 'C', '\0'};
+static constexpr uint32_t kDiskCacheVersion = 1;
+static constexpr uint32_t kDiskCacheDim = 384;
+static_assert(sizeof(DiskCacheHeader) == 64 && sizeof(DiskCacheSlot) == 32,
+              "disk cache layout is part of the file format");
+
+class DiskEmbeddingCache {
+private:
+    static constexpr size_t kProbe = 8;
+    static constexpr uint64_t kCheckSeed = 0x5bd1e9955bd1e995ULL;
+
+    int fd_ = -1;
+    uint8_t* data_ = nullptr;
+    size_t size_ = 0;
+    DiskCacheHeader* header_ = nullptr;
+    size_t slot_bytes_ = 0;
+    uint64_t slot_count_ = 0;
+    std::atomic<uint64_t> hits_{0};
+    std::atomic<uint64_t> misses_{0};
+    std::atomic<uint64_t> writes_{0};
+    std::mutex write_mutex_;
+
+    DiskCacheSlot* slot(uint64_t index) const {
+        return reinterpret_cast<DiskCacheSlot*>(data_ + sizeof(DiskCacheHeader) + index * slot_bytes_);
+    }
+
+    static float* slotVector(DiskCacheSlot* s) { return reinterpret_cast<float*>(s + 1); }
+
+    struct FileLock {
+        int fd;
+        explicit FileLock(int f) : fd(f) { while (flock(fd, LOCK_EX) != 0 && errno == EINTR) {} }
+        ~FileLock() { flock(fd, LOCK_UN); }
+    };
+
+    static bool headerValid(const DiskCacheHeader& h, size_t file_size) {
+        return std::memcmp(h.magic, kDiskCacheMagic, sizeof(kDiskCacheMagic)) == 0 &&
+               h.version == kDiskCacheVersion && h.dim > 0 && h.slot_count > 0 &&
+               h.slot_bytes >= sizeof(DiskCacheSlot) + h.dim * sizeof(float) &&
+               sizeof(DiskCacheHeader) + h.slot_count * h.slot_bytes <= file_size;
+    }
+
+    // Caller holds the writer lock. Parity is forced rather than assumed: a
+    // writer that died mid-slot leaves it odd, and the counter must never
+    // wrap to 0 (which readers take as the end of the probe chain).
+    void writeSlot(DiskCacheSlot* s, uint64_t model, uint64_t key, uint64_t check, const float* vector) {
+        uint32_t odd = __atomic_load_n(&s->seq, __ATOMIC_RELAXED) | 1;
+        if (odd == UINT32_MAX) odd = 1;
+        __atomic_store_n(&s->seq, odd, __ATOMIC_RELAXED);
+        std::atomic_thread_fence(std::memory_order_release);
+        s->stamp = static_cast<uint32_t>(header_->clock++);
+        s->model = model;
+        s->key = key;
+        s->check = check;
+        std::memcpy(slotVector(s), vector, header_->dim * sizeof(float));
+        __atomic_store_n(&s->seq, odd + 1, __ATOMIC_RELEASE);
+    }
+
+public:
+    DiskEmbeddingCache() = default;
+    DiskEmbeddingCache(const DiskEmbeddingCache&) = delete;
+    DiskEmbeddingCache& operator=(const DiskEmbeddingCache&) = delete;
+
+    ~DiskEmbeddingCache() {
+        if (data_) munmap(data_, size_);
+        if (fd_ >= 0) ::close(fd_);
+    }
+
+    // Opens (or creates with `capacity_bytes` worth of slots) a cache file.
+    // An existing file keeps its own geometry; one that is not a cache file
+    // is left untouched and the cache stays disabled.
+    bool open(const std::string& path, size_t capacity_bytes, uint32_t dim = kDiskCacheDim) {
+        int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) return false;
+
+        size_t file_size = 0;
+        {
+            FileLock lock(fd);
+            struct stat st;
+            if (fstat(fd, &st) != 0) {
+                ::close(fd);
+                return false;
+            }
+            file_size = static_cast<size_t>(st.st_size);
+
+            if (file_size == 0) {
+                DiskCacheHeader h{};
+                std::memcpy(h.magic, kDiskCacheMagic, sizeof(kDiskCacheMagic));
+                h.version = kDiskCacheVersion;
+                h.dim = dim;
+                h.slot_bytes = (sizeof(DiskCacheSlot) + dim * sizeof(float) + 63) & ~size_t(63);
+                h.slot_count = std::max<uint64_t>(kProbe, capacity_bytes / h.slot_bytes);
+                file_size = sizeof(DiskCacheHeader) + h.slot_count * h.slot_bytes;
+                // Sparse file: untouched slots read back as zero (seq 0 = empty)
+                if (ftruncate(fd, static_cast<off_t>(file_size)) != 0 ||
+                    pwrite(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h))) {
+                    ::close(fd);
+                    return false;
+                }
+            } else {
+                DiskCacheHeader h{};
+                if (pread(fd, &h, sizeof(h), 0) != static_cast<ssize_t>(sizeof(h)) || !headerValid(h, file_size)) {
+                    ::close(fd);
+                    return false;
+                }
+            }
+        }
+
+        void* data = mmap(nullptr, file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (data == MAP_FAILED) {
+            ::close(fd);
+            return false;
+        }
+
+        fd_ = fd;
+        data_ = static_cast<uint8_t*>(data);
+        size_ = file_size;
+        header_ = reinterpret_cast<DiskCacheHeader*>(data_);
+        slot_bytes_ = header_->slot_bytes;
+        slot_count_ = header_->slot_count;
+        return true;
+    }
+
+    size_t dim() const { return header_ ? header_->dim : 0; }
+
+    // Lock-free: never blocks on writers, a slot caught mid-write is a miss
+    bool lookup(const std::vector<int64_t>& ids, uint64_t model, float* out) {
+        const uint64_t key = hashTokens(ids.data(), ids.size(), model);
+        const uint64_t check = hashTokens(ids.data(), ids.size(), model ^ kCheckSeed);
+        const size_t bytes = header_->dim * sizeof(float);
+
+        for (size_t probe = 0; probe < kProbe; ++probe) {
+            DiskCacheSlot* s = slot((key + probe) % slot_count_);
+            uint32_t before = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+            if (before == 0) break;                 // never written: end of the probe chain
+            if (before & 1) continue;
+            if (s->key != key || s->model != model || s->check != check) continue;
+
+            std::memcpy(out, slotVector(s), bytes);
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (__atomic_load_n(&s->seq, __ATOMIC_RELAXED) == before) {
+                hits_.fetch_add(1, std::memory_order_relaxed);
+                return true;
+            }
+        }
+        misses_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    // Inserts rows[i] (dim floats each) for ids[i]; one writer lock per call
+    void insert(const std::vector<const std::vector<int64_t>*>& ids, const std::vector<const float*>& rows,
+                uint64_t model) {
+        // flock() doesn't exclude threads sharing this descriptor
+        std::lock_guard<std::mutex> thread_lock(write_mutex_);
+        FileLock lock(fd_);
+        for (size_t i = 0; i < ids.size(); ++i) {
+            const auto& seq = *ids[i];
+            const uint64_t key = hashTokens(seq.data(), seq.size(), model);
+            const uint64_t check = hashTokens(seq.data(), seq.size(), model ^ kCheckSeed);
+
+            // Same entry, else the first empty slot, else the oldest in the
+            // window. A slot that is odd while we hold the lock was left by a
+            // writer that died mid-write: it is garbage, reuse it.
+            DiskCacheSlot* target = nullptr;
+            uint32_t oldest_age = 0;
+            const uint32_t now = static_cast<uint32_t>(header_->clock);
+            for (size_t probe = 0; probe < kProbe; ++probe) {
+                DiskCacheSlot* s = slot((key + probe) % slot_count_);
+                if (s->seq == 0 || (s->seq & 1) || (s->key == key && s->model == model && s->check == check)) {
+                    target = s;
+                    break;
+                }
+                uint32_t age = now - s->stamp;
+                if (!target || age > oldest_age) {
+                    target = s;
+                    oldest_age = age;
+                }
+            }
+            writeSlot(target, model, key, check, rows[i]);
+        }
+        writes_.fetch_add(ids.size(), std::memory_order_relaxed);
+    }
+
+    std::string statsJson() const {
+        uint64_t hits = hits_.load(), misses = misses_.load();
+        std::ostringstream os;
+        os << "{\"slots\":" << slot_count_
+           << ",\"file_bytes\":" << size_
+           << ",\"hits\":" << hits
+           << ",\"misses\":" << misses
+           << ",\"writes\":" << writes_.load()
+           << ",\"hit_rate\":" << std::setprecision(4) << (hits + misses ? double(hits) / (hits + misses) : 0.0) << "}";
+        return os.str();
+    }
+
+    void printReport(std::ostream& os) const {
+        uint64_t hits = hits_.load(), misses = misses_.load();
+        os << "Disk cache: " << hits << " hits, " << misses << " misses ("
+           << std::fixed << std::setprecision(1) << (hits + misses ? 100.0 * hits / (hits + misses) : 0.0)
+           << "% hit rate), " << writes_.load() << " writes, " << slot_count_ << " slots" << std::defaultfloat << std::endl;
+    }
+};
+
+// ============================================================================
+// Arctic Embed Model
+// ============================================================================
+
+enum class Precision { FP32, INT8, BF16, FP16 };
+
+static Precision parsePrecision(const std::string& name) {
+    if (name == "fp32") return Precision::FP32;
+    if (name == "int8") return Precision::INT8;
+    if (name == "bf16") return Precision::BF16;
+    if (name == "fp16") return Precision::FP16;
+    throw std::invalid_argument("unknown precision: " + name + " (expected fp32|int8|bf16|fp16)");
+}
+
+static const char* precisionName(Precision precision) {
+    switch (precision) {
+        case Precision::INT8: return "int8";
+        case Precision::BF16: return "bf16";
+        case Precision::FP16: return "fp16";
+        default: return "fp32";
+    }
+}
+
+// Weight/activation dtype of the half-precision modes (nullopt otherwise)
+static c10::optional<at::ScalarType> halfDtype(Precision precision) {
+    if (precision == Precision::BF16) return at::kBFloat16;
+    if (precision == Precision::FP16) return at::kHalf;
+    return c10::nullopt;
+}
+
+// Enables autocast for one forward pass in the half-precision modes. The
+// weights are already cast at load; this catches fp32 tensors created
+// inside the traced graph (e.g. the extended attention-mask bias) so the
+// matmuls don't get promoted back to fp32. Autocast state is thread-local.
+class AutocastScope {
+private:
+    at::DeviceType type_;
+    bool active_;
+    bool prev_enabled_ = false;
+    at::ScalarType prev_dtype_ = at::kFloat;
+
+public:
+    AutocastScope(at::DeviceType type, Precision precision)
+        : type_(type), active_(halfDtype(precision).has_value() && at::autocast::is_autocast_available(type)) {
+        if (!active_) return;
+        prev_enabled_ = at::autocast::is_autocast_enabled(type_);
+        prev_dtype_ = at::autocast::get_autocast_dtype(type_);
+        at::autocast::set_autocast_dtype(type_, *halfDtype(precision));
+        at::autocast::set_autocast_enabled(type_, true);
+    }
+
+    ~AutocastScope() {
+        if (!active_) return;
+        at::autocast::set_autocast_enabled(type_, prev_enabled_);
+        at::autocast::set_autocast_dtype(type_, prev_dtype_);
+    }
+
+    AutocastScope(const AutocastScope&) = delete;
+    AutocastScope& operator=(const AutocastScope&) = delete;
+};
+
+struct EngineConfig {
+    std::string device = "auto";   // cpu | mps | auto (MPS when available, else CPU)
+    Precision precision = Precision::FP32;
+    bool optimize = false;         // freeze + optimize_for_inference, cached next to the model
+    int max_batch = 32;            // rows of 512 tokens preallocated for input staging
+    int num_threads = 0;           // intra-op threads, 0 = libtorch default
+    int interop_threads = 0;       // inter-op threads, 0 = libtorch default
+    size_t cache_bytes = 0;        // in-process embedding cache, 0 = off
+    std::string disk_cache_path;   // shared on-disk cache file, empty = off
+    size_t disk_cache_bytes = 64 * 1024 * 1024;   // size of a newly created cache file
+};
+
+class ArcticEmbedLibTorch {
+private:
+    static constexpr int64_t kPadId = 0;   // [PAD]; padded positions are masked out anyway
+
+    torch::jit::script::Module model_;
+    torch::Device device_;
+    Precision precision_;
+    bool fused_ = false;                    // forward returns pooled + normalized [B, dim]
+    bool frozen_ = false;                   // --optimize: weights are graph constants
+    // Reusable int64 input staging (CPU), max_batch x 512 tokens: filled in
+    // place and viewed as [B, L] via narrow(). Only grows (doubling) when a
+    // batch exceeds it, so steady-state calls don't allocate input tensors.
+    // One forward at a time per engine (the scheduler worker, or the caller
+    // in one-shot modes).
+    torch::Tensor stage_ids_;
+    torch::Tensor stage_mask_;
+    uint64_t model_id_ = 0;                 // cache key seed: model file + execution setup
+    std::atomic<size_t> dim_{0};            // embedding width, known after the first forward
+    // Shared with replicas (both caches are thread-safe)
+    std::shared_ptr<EmbeddingCache> cache_;
+    std::shared_ptr<DiskEmbeddingCache> disk_cache_;
+
+    void loadTraced(const std::string& path) {
+        // The model is traced on MPS; map it straight to the target device
+        model_ = torch::jit::load(path, device_);
+        model_.to(device_);
+        // Half precision: cast the weights once here, not per call
+        if (auto dtype = halfDtype(precision_)) {
+            model_.to(*dtype);
+        }
+        model_.eval();
+    }
+
+    // Frozen + optimized artifacts live next to the model, named by a setup
+    // key (libtorch version, device, precision) and a hash of the model's
+    // full contents:
+    //   arctic_model_mps.pt -> arctic_model_mps.opt-<setup>-<content>.pt
+    // ".opt-" holds the graph after optimize_for_inference. Some optimized
+    // graphs carry constants that cannot be serialized (e.g. MKLDNN-packed
+    // weights); then the frozen graph is stored as ".frozen-" and only the
+    // cheap optimization passes re-run on load.
+    static std::string artifactStem(const std::string& path) {
+        std::string stem = path;
+        if (stem.size() > 3 && stem.compare(stem.size() - 3, 3, ".pt") == 0) stem.resize(stem.size() - 3);
+        return stem;
+    }
+
+    static std::string optimizedArtifactPath(const std::string& path, const char* kind, uint32_t setup,
+                                             uint64_t content) {
+        char key[26];
+        std::snprintf(key, sizeof(key), "%08x-%016llx", setup, static_cast<unsigned long long>(content));
+        return artifactStem(path) + "." + kind + "-" + key + ".pt";
+    }
+
+    // Deletes artifacts for the same setup built from an earlier version of
+    // the model, keeping `current`. Artifacts of other devices/precisions are
+    // still valid and stay.
+    static void removeSupersededArtifacts(const std::string& path, uint32_t setup, const std::string& current) {
+        const std::string stem = artifactStem(path);
+        const size_t slash = stem.find_last_of('/');
+        const std::string dir = slash == std::string::npos ? "." : stem.substr(0, slash + 1);
+        const std::string base = slash == std::string::npos ? stem : stem.substr(slash + 1);
+        char setup_hex[9];
+        std::snprintf(setup_hex, sizeof(setup_hex), "%08x", setup);
+
+        DIR* d = ::opendir(dir.c_str());
+        if (!d) return;
+        while (dirent* entry = ::readdir(d)) {
+            std::string_view name(entry->d_name);
+            if (name.size() <= base.size() + 1 || name.compare(0, base.size(), base) != 0 || name[base.size()] != '.') {
+                continue;
+            }
+            std::string_view rest = name.substr(base.size() + 1);
+            size_t dash = rest.find('-');
+            if (dash == std::string_view::npos) continue;
+            std::string_view kind = rest.substr(0, dash);
+            std::string_view key = rest.substr(dash + 1);
+            if (kind != "opt" && kind != "frozen") continue;
+            if (key.size() < 3 || key.substr(key.size() - 3) != ".pt") continue;
+            key.remove_suffix(3);
+            auto hex = [](std::string_view v) {
+                return std::all_of(v.begin(), v.end(), [](char c) { return std::isxdigit(static_cast<unsigned char>(c)); });
+            };
+            bool same_setup = key.size() == 25 && key[8] == '-' && key.substr(0, 8) == setup_hex &&
+                              hex(key.substr(9));
+            if (!same_setup) continue;
+            std::string victim = (slash == std::string::npos ? "" : dir) + std::string(name);
+            if (victim != current) std::remove(victim.c_str());
+        }
+        ::closedir(d);
+    }
+
+    static bool saveAtomically(const torch::jit::script::Module& module, const std::string& path) {
+        std::string tmp = path + ".tmp." + std::to_string(getpid());
+        try {
+            module.save(tmp);
+        } catch (const c10::Error&) {
+            std::remove(tmp.c_str());
+            return false;
+        }
+        return std::rename(tmp.c_str(), path.c_str()) == 0;
+    }
+
+    torch::jit::script::Module optimizeFrozen(torch::jit::script::Module frozen) const {
+        // optimize_for_inference targets CPU kernels (linear/conv prepacking,
+        // MKLDNN conversion); on MPS only freezing applies
+        return device_.is_cpu() ? torch::jit::optimize_for_inference(frozen) : frozen;
+    }
+
+    void loadOptimized(const std::string& path, bool quiet) {
+        static const uint64_t kTorchVersion = hashBytes(TORCH_VERSION, std::strlen(TORCH_VERSION), 0);
+        const uint64_t setup_bits = static_cast<uint64_t>(device_.type()) | (static_cast<uint64_t>(precision_) << 16);
+        const uint32_t setup = static_cast<uint32_t>(mix64(setup_bits ^ kTorchVersion));
+        // The whole file, not fingerprintFile(): loading a stale graph for a
+        // re-exported model would be silent. Memoized so that only the first
+        // start after the model changes pays for reading all of it.
+        const uint64_t content = memoizedFileHash(path, artifactStem(path) + ".content-hash");
+        const std::string opt_path = optimizedArtifactPath(path, "opt", setup, content);
+        const std::string frozen_path = optimizedArtifactPath(path, "frozen", setup, content);
+
+        struct stat st;
+        if (stat(opt_path.c_str(), &st) == 0) {
+            model_ = torch::jit::load(opt_path, device_);
+            return;
+        }
+        if (stat(frozen_path.c_str(), &st) == 0) {
+            model_ = optimizeFrozen(torch::jit::load(frozen_path, device_));
+            return;
+        }
+
+        auto start = std::chrono::high_resolution_clock::now();
+        loadTraced(path);
+        auto frozen = torch::jit::freeze(model_);
+        model_ = optimizeFrozen(frozen);
+
+        const char* saved = nullptr;
+        if (saveAtomically(model_, opt_path)) {
+            saved = opt_path.c_str();
+        } else if (saveAtomically(frozen, frozen_path)) {
+            saved = frozen_path.c_str();
+        }
+        if (saved) removeSupersededArtifacts(path, setup, saved);
+        if (!quiet) {
+            auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                std::chrono::high_resolution_clock::now() - start).count();
+            std::cerr << "Optimized model in " << ms << " ms";
+            if (saved) {
+                std::cerr << ", cached as " << saved << std::endl;
+            } else {
+                std::cerr << " (could not write the optimized artifact next to the model)" << std::endl;
+            }
+        }
+    }
+
+    // Runs the model and returns its output as fp32: in the half
+    // precision modes only the forward pass runs in bf16/fp16, pooling and
+    // normalization always accumulate in fp32.
+    //
+    // Fused modules (scripts/export_model.py --fused) already return the
+    // pooled, L2-normalized [B, dim] tensor; it is passed through as is.
+    torch::Tensor forwardModel(std::vector<torch::jit::IValue>& inputs) {
+        c10::IValue output;
+        {
+            AutocastScope autocast(device_.type(), precision_);
+            output = model_.forward(inputs);
+        }
+        auto tensor = fused_ ? output.toTensor() : output.toGenericDict().at("last_hidden_state").toTensor();
+        return tensor.scalar_type() == torch::kFloat ? tensor : tensor.to(torch::kFloat);
+    }
+
+    void reserveStaging(int64_t tokens) {
+        if (stage_ids_.defined() && stage_ids_.numel() >= tokens) return;
+        int64_t capacity = std::max<int64_t>(tokens, stage_ids_.defined() ? stage_ids_.numel() * 2 : 0);
+        stage_ids_ = torch::empty({capacity}, torch::kLong);
+        stage_mask_ = torch::empty({capacity}, torch::kLong);
+    }
+
+    // [B, L] views of the filled staging buffers, on device_. On CPU these
+    // are the staging memory itself: no clone, no copy.
+    std::vector<torch::jit::IValue> stagedInputs(int64_t B, int64_t L) {
+        auto ids = stage_ids_.narrow(0, 0, B * L).view({B, L});
+        auto mask = stage_mask_.narrow(0, 0, B * L).view({B, L});
+        if (!device_.is_cpu()) {
+            ids = ids.to(device_);
+            mask = mask.to(device_);
+        }
+        return {ids, mask};
+    }
+
+    // CPU post-processing: the SIMD kernel pools and normalizes straight from
+    // the hidden state into the result, no temporary tensors. (On MPS the
+    // hidden state stays on the GPU and is pooled with tensor ops.)
+    std::vector<float> poolHidden(const torch::Tensor& last_hidden_state, const int64_t* mask) {
+        auto hidden = last_hidden_state.contiguous();   // [B, L, H]
+        const size_t B = static_cast<size_t>(hidden.size(0));
+        const size_t L = static_cast<size_t>(hidden.size(1));
+        const size_t H = static_cast<size_t>(hidden.size(2));
+        std::vector<float> out(B * H);
+        kPoolNormalize.fn(hidden.data_ptr<float>(), mask, B, L, H, out.data());
+        dim_.store(H, std::memory_order_relaxed);
+        return out;
+    }
+
+    // Export format is read off the forward schema: Tensor = fused,
+    // Dict(str, Tensor) = traced encoder output
+    static bool returnsTensor(torch::jit::script::Module& module) {
+        const auto& returns = module.get_method("forward").function().getSchema().returns();
+        return returns.size() == 1 && returns[0].type()->kind() == c10::TypeKind::TensorType;
+    }
+
+    // Memory tier first, then the shared disk tier (promoting hits)
+    bool lookupTiers(uint64_t key, const std::vector<int64_t>& ids, float* out, size_t dim) {
+        if (cache_ && cache_->lookup(key, ids, out, dim)) return true;
+        if (disk_cache_ && disk_cache_->dim() == dim && disk_cache_->lookup(ids, model_id_, out)) {
+            if (cache_) cache_->insert(key, ids, out, dim);
+            return true;
+        }
+        return false;
+    }
+
+    // Must match the engine the int8 artifact was packed for: fbgemm on x86,
+    // qnnpack on ARM
+    static void selectQuantizedEngine() {
+#if defined(__aarch64__) || defined(__arm64__)
+        const at::QEngine wanted = at::QEngine::QNNPACK;
+#else
+        const at::QEngine wanted = at::QEngine::FBGEMM;
+#endif
+        const auto& supported = at::globalContext().supportedQEngines();
+        if (std::find(supported.begin(), supported.end(), wanted) == supported.end()) {
+            throw std::runtime_error(std::string("this libtorch build lacks the ") + c10::toString(wanted) +
+                                     " quantized engine needed for --precision int8");
+        }
+        at::globalContext().setQEngine(wanted);
+    }
+
+    // Thread pools are process-wide; set them before the first forward pass
+    static void configureThreads(const EngineConfig& config) {
+        if (config.interop_threads > 0) {
+            try {
+                torch::set_num_interop_threads(config.interop_threads);
+            } catch (const c10::Error&) {
+                std::cerr << "Warning: inter-op thread pool already started, ignoring --interop-threads" << std::endl;
+            }
+        }
+        if (config.num_threads > 0) {
+            torch::set_num_threads(config.num_threads);
+        }
+    }
+
+public:
+    static torch::Device resolveDevice(const std::string& name) {
+        if (name == "cpu") return torch::kCPU;
+        if (name == "mps") {
+            if (!torch::mps::is_available()) {
+                throw std::runtime_error("MPS device requested but not available");
+            }
+            return torch::kMPS;
+        }
+        if (name == "auto") {
+            return torch::mps::is_available() ? torch::Device(torch::kMPS) : torch::Device(torch::kCPU);
+        }
+        throw std::invalid_argument("unknown device: " + name + " (expected cpu|mps|auto)");
+    }
+
+    // Device the engine will actually run on: quantized kernels are CPU-only
+    static torch::Device resolveDevice(const EngineConfig& config) {
+        if (config.precision == Precision::INT8) {
+            if (config.device == "mps") {
+                throw std::invalid_argument("--precision int8 runs on CPU only (dynamic quantization has no MPS kernels)");
+            }
+            return torch::kCPU;
+        }
+        return resolveDevice(config.device);
+    }
+
+    // int8 uses a pre-quantized artifact exported next to the fp32 model:
+    // arctic_model_mps.pt -> arctic_model_int8.pt (scripts/export_model.py)
+    static std::string resolveModelPath(const std::string& model_path, const EngineConfig& config) {
+        if (config.precision != Precision::INT8 || model_path.find("int8") != std::string::npos) {
+            return model_path;
+        }
+        std::string stem = model_path;
+        if (stem.size() > 3 && stem.compare(stem.size() - 3, 3, ".pt") == 0) stem.resize(stem.size() - 3);
+        for (const char* suffix : {"_mps", "_fp32"}) {
+            size_t len = std::strlen(suffix);
+            if (stem.size() > len && stem.compare(stem.size() - len, len, suffix) == 0) {
+                stem.resize(stem.size() - len);
+                break;
+            }
+        }
+        std::string quantized = stem + "_int8.pt";
+        struct stat st;
+        if (stat(quantized.c_str(), &st) != 0) {
+            throw std::runtime_error("int8 model not found: " + quantized +
+                                     " (run: python scripts/export_model.py --precision int8)");
+        }
+        return quantized;
+    }
+
+    // The fp32 model a quantized artifact was exported from, the inverse of
+    // the int8 lookup above: arctic_model_int8.pt -> arctic_model_mps.pt,
+    // arctic_model_fused_int8.pt -> arctic_model_fused.pt. Paths that do not
+    // name an int8 artifact are their own reference. Empty if not found.
+    static std::string referenceModelPath(const std::string& model_path) {
+        const size_t name = model_path.find_last_of('/') + 1;   // npos + 1 == 0
+        if (model_path.find("int8", name) == std::string::npos) return model_path;
+        std::string stem = model_path;
+        if (stem.size() > 3 && stem.compare(stem.size() - 3, 3, ".pt") == 0) stem.resize(stem.size() - 3);
+        size_t at = stem.rfind("_int8");
+        if (at == std::string::npos || at < name) return {};
+        stem.erase(at, 5);
+        for (const char* suffix : {"", "_mps", "_fp32"}) {
+            std::string candidate = stem + suffix + ".pt";
+            struct stat st;
+            if (stat(candidate.c_str(), &st) == 0) return candidate;
+        }
+        return {};
+    }
+
+    // Cache identity of a model file as run on `device`. Static so the disk
+    // cache can be consulted before (or instead of) loading the model.
+    static uint64_t modelIdentity(const std::string& model_path, const torch::Device& device, Precision precision) {
+        uint64_t setup = static_cast<uint64_t>(device.type()) | (static_cast<uint64_t>(precision) << 16);
+        return mix64(fingerprintFile(model_path) ^ setup);
+    }
+
+    static uint64_t modelIdentity(const std::string& model_path, const EngineConfig& config) {
+        return modelIdentity(resolveModelPath(model_path, config), resolveDevice(config), config.precision);
+    }
+
+    ArcticEmbedLibTorch(const std::string& model_path, bool quiet = false,
+                        const EngineConfig& config = EngineConfig())
+        : device_(resolveDevice(config)), precision_(config.precision) {
+
+        if (device_.is_cpu()) {
+            configureThreads(config);
+        }
+        if (precision_ == Precision::INT8) {
+            selectQuantizedEngine();
+        }
+
+        const std::string path = resolveModelPath(model_path, config);
+        if (!quiet) {
+            std::cerr << "Loading " << precisionName(precision_) << " model on " << (device_.is_cpu() ? "CPU" : "MPS");
+            if (device_.is_cpu()) {
+                std::cerr << " (" << torch::get_num_threads() << " intra-op threads)";
+            }
+            std::cerr << "..." << std::endl;
+        }
+
+        try {
+            if (config.optimize) {
+                loadOptimized(path, quiet);
+                frozen_ = true;
+            } else {
+                loadTraced(path);
+            }
+            fused_ = returnsTensor(model_);
+        } catch (const c10::Error& e) {
+            std::cerr << "Error loading model: " << e.what() << std::endl;
+            throw;
+        }
+
+        if (!quiet && precision_ == Precision::BF16 && device_.is_cpu() &&
+            !at::cpu::is_avx512_bf16_supported() && !at::cpu::is_amx_tile_supported()) {
+            std::cerr << "Warning: this CPU has no native bf16 (AVX512-BF16/AMX); bf16 will likely be slower than fp32"
+                      << std::endl;
+        }
+
+        reserveStaging(static_cast<int64_t>(std::max(1, config.max_batch)) * 512);
+
+        model_id_ = modelIdentity(path, device_, precision_);
+        if (config.cache_bytes > 0) {
+            cache_ = std::make_shared<EmbeddingCache>(config.cache_bytes);
+        }
+        if (!config.disk_cache_path.empty()) {
+            disk_cache_ = std::make_shared<DiskEmbeddingCache>();
+            if (!disk_cache_->open(config.disk_cache_path, config.disk_cache_bytes)) {
+                std::cerr << "Warning: cannot use disk cache " << config.disk_cache_path << ", continuing without it" << std::endl;
+                disk_cache_.reset();
+            }
+        }
+    }
+
+    // Replica of a loaded engine. The TorchScript module handle is shared, so
+    // all replicas run the same read-only weights (forward is safe to call
+    // concurrently), along with the caches; each replica gets its own input
+    // staging so replicas can run forward passes in parallel.
+    ArcticEmbedLibTorch(const ArcticEmbedLibTorch& primary, int max_batch)
+        : model_(primary.model_), device_(primary.device_), precision_(primary.precision_),
+          fused_(primary.fused_), frozen_(primary.frozen_), model_id_(primary.model_id_), dim_(primary.dim_.load()),
+          cache_(primary.cache_), disk_cache_(primary.disk_cache_) {
+        reserveStaging(static_cast<int64_t>(std::max(1, max_batch)) * 512);
+    }
+
+    // Same, but with a private deep copy of the weights, allocated by the
+    // calling thread (NUMA first-touch). Frozen graphs (--optimize) keep
+    // their weights as graph constants, which clone() does not copy; see
+    // frozen().
+    ArcticEmbedLibTorch(const ArcticEmbedLibTorch& primary, int max_batch, bool copy_weights)
+        : ArcticEmbedLibTorch(primary, max_batch) {
+        if (copy_weights) {
+            c10::InferenceMode inference_mode;
+            model_ = primary.model_.clone();
+            model_.eval();
+        }
+    }
+
+    size_t dim() const {
+        size_t dim = dim_.load(std::memory_order_relaxed);
+        return dim == 0 && disk_cache_ ? disk_cache_->dim() : dim;
+    }
+    uint64_t modelId() const { return model_id_; }
+    bool hasCache() const { return cache_ || disk_cache_; }
+    bool fused() const { return fused_; }
+    bool frozen() const { return frozen_; }
+
+    uint64_t cacheKey(const std::vector<int64_t>& ids) const {
+        return hashTokens(ids.data(), ids.size(), model_id_);
+    }
+
+    // Cache-only lookup (no forward pass); `out` must hold dim() floats
+    bool lookupCached(const std::vector<int64_t>& ids, float* out) {
+        size_t dim = this->dim();
+        return dim > 0 && lookupTiers(cacheKey(ids), ids, out, dim);
+    }
+
+    // Stores a vector computed outside embedBatch (e.g. by embed())
+    void storeCached(const std::vector<int64_t>& ids, const float* vector, size_t dim) {
+        if (cache_) cache_->insert(cacheKey(ids), ids, vector, dim);
+        if (disk_cache_ && disk_cache_->dim() == dim) disk_cache_->insert({&ids}, {vector}, model_id_);
+    }
+
+    void writeCacheStats(std::ostream& os) const {
+        if (cache_) os << ",\"cache\":" << cache_->statsJson();
+        if (disk_cache_) os << ",\"disk_cache\":" << disk_cache_->statsJson();
+    }
+
+    void printCacheReport(std::ostream& os) const {
+        if (cache_) cache_->printReport(os);
+        if (disk_cache_) disk_cache_->printReport(os);
+    }
+
+    const torch::Device& device() const { return device_; }
+    Precision precision() const { return precision_; }
+
+    std::vector<float> embed(const std::vector<int64_t>& input_ids,
+                             const std::vector<int64_t>& attention_mask) {
+        c10::InferenceMode inference_mode;
+
+        const int64_t L = static_cast<int64_t>(input_ids.size());
+        reserveStaging(L);
+        std::copy(input_ids.begin(), input_ids.end(), stage_ids_.data_ptr<int64_t>());
+        std::copy(attention_mask.begin(), attention_mask.end(), stage_mask_.data_ptr<int64_t>());
+        auto inputs = stagedInputs(1, L);
+
+        if (!fused_ && device_.is_cpu()) {
+            return poolHidden(forwardModel(inputs), attention_mask.data());
+        }
+
+        torch::Tensor normalized;
+        if (fused_) {
+            normalized = forwardModel(inputs).squeeze(0);
+        } else {
+            auto last_hidden_state = forwardModel(inputs);
+
+            // Mean pooling
+            auto pooled = last_hidden_state.mean(1).squeeze(0);
+
+            // L2 normalize
+            auto norm = pooled.norm(2);
+            normalized = pooled / norm;
+        }
+
+        auto cpu_tensor = device_.is_cpu() ? normalized.contiguous() : normalized.to(torch::kCPU);
+        auto data_ptr = cpu_tensor.data_ptr<float>();
+        dim_.store(static_cast<size_t>(cpu_tensor.numel()), std::memory_order_relaxed);
+
+        return std::vector<float>(data_ptr, data_ptr + cpu_tensor.numel());
+    }
+
+    // Batched embedding with the cache in front: hits are copied out, only
+    // the misses go through one forward pass and are then cached. Pass
+    // lookup_cache = false when the caller already looked the rows up (the
+    // scheduler does so at submit time); results are still inserted.
+    std::vector<float> embedBatch(const std::vector<std::vector<int64_t>>& batch, bool lookup_cache = true) {
+        if (!hasCache() || batch.empty()) return forwardBatch(batch);
+
+        const size_t B = batch.size();
+        size_t dim = this->dim();
+        std::vector<uint64_t> keys(B);
+        std::vector<float> out(B * dim);
+        std::vector<size_t> misses;
+        for (size_t b = 0; b < B; ++b) {
+            keys[b] = cacheKey(batch[b]);
+            if (!lookup_cache || dim == 0 || !lookupTiers(keys[b], batch[b], out.data() + b * dim, dim)) {
+                misses.push_back(b);
+            }
+        }
+        if (misses.empty()) return out;
+
+        std::vector<float> fresh;
+        if (misses.size() == B) {
+            fresh = forwardBatch(batch);
+        } else {
+            std::vector<std::vector<int64_t>> sub;
+            sub.reserve(misses.size());
+            for (size_t b : misses) sub.push_back(batch[b]);
+            fresh = forwardBatch(sub);
+        }
+
+        dim = fresh.size() / misses.size();
+        out.resize(B * dim);
+        std::vector<const std::vector<int64_t>*> disk_ids;
+        std::vector<const float*> disk_rows;
+        for (size_t m = 0; m < misses.size(); ++m) {
+            size_t b = misses[m];
+            const float* row = fresh.data() + m * dim;
+            std::copy(row, row + dim, out.data() + b * dim);
+            if (cache_) cache_->insert(keys[b], batch[b], row, dim);
+            disk_ids.push_back(&batch[b]);
+            disk_rows.push_back(row);
+        }
+        if (disk_cache_ && disk_cache_->dim() == dim) disk_cache_->insert(disk_ids, disk_rows, model_id_);
+        return out;
+    }
+
+    // Batched forward pass. Sequences are right-padded to a {B, L} tensor with
+    // a real attention mask, pooled with a masked mean (padding must not leak
+    // into the average) and L2-normalized row-wise. Returns one contiguous
+    // B x dim buffer (row i = batch[i]).
+    std::vector<float> forwardBatch(const std::vector<std::vector<int64_t>>& batch) {
+        if (batch.empty()) return {};
+
+        c10::InferenceMode inference_mode;
+
+        const int64_t B = static_cast<int64_t>(batch.size());
+        int64_t L = 0;
+        for (const auto& ids : batch) {
+            L = std::max(L, static_cast<int64_t>(ids.size()));
+        }
+
+        reserveStaging(B * L);
+        int64_t* padded_ids = stage_ids_.data_ptr<int64_t>();
+        int64_t* padded_mask = stage_mask_.data_ptr<int64_t>();
+        for (int64_t b = 0; b < B; ++b) {
+            const auto& ids = batch[b];
+            const int64_t n = static_cast<int64_t>(ids.size());
+            std::copy(ids.begin(), ids.end(), padded_ids + b * L);
+            std::fill(padded_ids + b * L + n, padded_ids + (b + 1) * L, kPadId);
+            std::fill(padded_mask + b * L, padded_mask + b * L + n, 1);
+            std::fill(padded_mask + b * L + n, padded_mask + (b + 1) * L, 0);
+        }
+        auto inputs = stagedInputs(B, L);
+
+        if (!fused_ && device_.is_cpu()) {
+            return poolHidden(forwardModel(inputs), padded_mask);
+        }
+
+        torch::Tensor normalized;
+        if (fused_) {
+            normalized = forwardModel(inputs);                   // [B, H]
+        } else {
+            auto last_hidden_state = forwardModel(inputs);       // [B, L, H]
+
+            // Masked mean pooling
+            auto mask = inputs[1].toTensor().unsqueeze(-1).to(last_hidden_state.scalar_type());
+            auto summed = (last_hidden_state * mask).sum(1);
+            auto counts = mask.sum(1).clamp_min(1e-9);
+            auto pooled = summed / counts;
+
+            // Row-wise L2 normalize
+            normalized = pooled / pooled.norm(2, 1, true).clamp_min(1e-12);
+        }
+
+        auto cpu_tensor = device_.is_cpu() ? normalized.contiguous() : normalized.to(torch::kCPU).contiguous();
+        auto data_ptr = cpu_tensor.data_ptr<float>();
+        dim_.store(static_cast<size_t>(cpu_tensor.size(1)), std::memory_order_relaxed);
+
+        return std::vector<float>(data_ptr, data_ptr + cpu_tensor.numel());
+    }
+};
+
+// ============================================================================
+// Replica Pool (shared weights, pinned core sets, NUMA placement)
+// ============================================================================
+
+// Where a replica's worker runs: the CPUs it is pinned to (empty = not
+// pinned) and its intra-op thread count (0 = libtorch default).
+struct ReplicaPlacement {
+    std::vector<int> cpus;
+    int threads = 0;
+    int node = -1;              // NUMA node, -1 = not NUMA-placed
+};
+
+struct NumaNode {
+    int id;
+    std::vector<int> cpus;      // usable CPUs of the node
+};
+
+// CPUs this process may run on, in order
+static std::vector<int> availableCpus() {
+    std::vector<int> cpus;
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+        for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+            if (CPU_ISSET(cpu, &set)) cpus.push_back(cpu);
+        }
+    }
+#endif
+    if (cpus.empty()) {
+        unsigned n = std::max(1u, std::thread::hardware_concurrency());
+        for (unsigned cpu = 0; cpu < n; ++cpu) cpus.push_back(static_cast<int>(cpu));
+    }
+    return cpus;
+}
+
+// "0-3,8" style list for reports
+static std::string formatCpuList(const std::vector<int>& cpus) {
+    if (cpus.empty()) return "any";
+    std::string out;
+    for (size_t i = 0; i < cpus.size();) {
+        size_t j = i;
+        while (j + 1 < cpus.size() && cpus[j + 1] == cpus[j] + 1) ++j;
+        if (!out.empty()) out += ",";
+        out += std::to_string(cpus[i]);
+        if (j > i) out += "-" + std::to_string(cpus[j]);
+        i = j + 1;
+    }
+    return out;
+}
+
+// Parses a sysfs cpulist ("0-3,8-11")
+static std::vector<int> parseCpuList(const std::string& text) {
+    std::vector<int> cpus;
+    std::stringstream list(text);
+    std::string range;
+    while (std::getline(list, range, ',')) {
+        if (range.empty() || !std::isdigit(static_cast<unsigned char>(range[0]))) continue;
+        auto dash = range.find('-');
+        int first = std::atoi(range.c_str());
+        int last = dash == std::string::npos ? first : std::atoi(range.c_str() + dash + 1);
+        for (int cpu = first; cpu <= last; ++cpu) cpus.push_back(cpu);
+    }
+    return cpus;
+}
+
+// NUMA nodes from /sys/devices/system/node, restricted to the CPUs this
+// process may use; memory-only nodes are dropped. Empty (or one node) when
+// the machine is not NUMA or sysfs is unavailable.
+static std::vector<NumaNode> detectNumaNodes() {
+    std::vector<NumaNode> nodes;
+#if defined(__linux__)
+    const auto usable = availableCpus();
+    for (int id = 0; id < 1024; ++id) {
+        std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+        if (!file) {
+            // Node ids can be sparse; stop after a long gap
+            if (id >= 64 && (nodes.empty() || id - nodes.back().id > 64)) break;
+            continue;
+        }
+        std::string text;
+        std::getline(file, text);
+        NumaNode node{id, {}};
+        for (int cpu : parseCpuList(text)) {
+            if (std::find(usable.begin(), usable.end(), cpu) != usable.end()) node.cpus.push_back(cpu);
+        }
+        if (!node.cpus.empty()) nodes.push_back(std::move(node));
+    }
+#endif
+    return nodes;
+}
+
+static void pinCurrentThread(const std::vector<int>& cpus) {
+#if defined(__linux__)
+    if (cpus.empty()) return;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    for (int cpu : cpus) CPU_SET(cpu, &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+        std::cerr << "Warning: could not pin thread to CPUs " << formatCpuList(cpus) << std::endl;
+    }
+#else
+    (void)cpus;
+#endif
+}
+
+// Applies a placement to the calling thread. Must run before the thread's
+// first parallel op: OpenMP workers are spawned on first use and inherit the
+// affinity mask, and the OpenMP intra-op thread count is per calling thread.
+// (Affinity is Linux-only; elsewhere only the thread count applies.)
+static void applyPlacement(const ReplicaPlacement& placement) {
+    pinCurrentThread(placement.cpus);
+    if (placement.threads > 0) {
+        // get_num_threads() runs this thread's lazy init first; otherwise the
+        // first parallel op would re-apply the process-wide count (whatever
+        // the last replica set) over ours
+        at::get_num_threads();
+        at::set_num_threads(placement.threads);
+    } else {
+        at::init_num_threads();
+    }
+}
+
+// N engines sharing one set of weights, each with its own staging buffers and
+// placement. On a single node, replica 0 is the caller's engine and the pool
+// owns the rest. Across NUMA nodes, every node gets its own weight copy
+// (made by a thread pinned to that node, so first-touch allocates it there)
+// shared by the replicas placed on that node; the caller's engine then only
+// serves cache lookups.
+class ReplicaPool {
+private:
+    ArcticEmbedLibTorch* primary_;
+    std::vector<std::unique_ptr<ArcticEmbedLibTorch>> owned_;
+    std::vector<ArcticEmbedLibTorch*> replicas_;
+    std::vector<ReplicaPlacement> placement_;
+
+    // Builds a replica from a thread pinned to `cpus` (first-touch placement)
+    static std::unique_ptr<ArcticEmbedLibTorch> buildOn(const std::vector<int>& cpus, const ArcticEmbedLibTorch& source,
+                                                        int max_batch, bool copy_weights) {
+        std::unique_ptr<ArcticEmbedLibTorch> engine;
+        std::exception_ptr error;
+        std::thread builder([&] {
+            try {
+                pinCurrentThread(cpus);
+                engine = copy_weights ? std::make_unique<ArcticEmbedLibTorch>(source, max_batch, true)
+                                      : std::make_unique<ArcticEmbedLibTorch>(source, max_batch);
+            } catch (...) {
+                error = std::current_exception();
+            }
+        });
+        builder.join();
+        if (error) std::rethrow_exception(error);
+        return engine;
+    }
+
+    void planSingleNode(ArcticEmbedLibTorch& primary, int count, int threads, int max_batch,
+                        const std::vector<int>& cpus) {
+        if (threads <= 0) threads = std::max(1, static_cast<int>(cpus.size()) / count);
+        const bool pin = static_cast<size_t>(count) * threads <= cpus.size();
+        if (!pin) {
+            std::cerr << "Warning: " << count << " replicas x " << threads << " threads exceeds "
+                      << cpus.size() << " CPUs; replicas will not be pinned" << std::endl;
+        }
+        for (int r = 0; r < count; ++r) {
+            if (r == 0) {
+                replicas_.push_back(&primary);
+            } else {
+                owned_.push_back(std::make_unique<ArcticEmbedLibTorch>(primary, max_batch));
+                replicas_.push_back(owned_.back().get());
+            }
+            ReplicaPlacement placement;
+            placement.threads = threads;
+            if (pin) {
+                placement.cpus.assign(cpus.begin() + r * threads, cpus.begin() + (r + 1) * threads);
+            }
+            placement_.push_back(std::move(placement));
+        }
+    }
+
+    // Replicas round-robin over nodes; core sets never cross a node. When a
+    // node has too few CPUs for disjoint sets its replicas share the whole
+    // node, which still keeps them node-local.
+    void planNuma(ArcticEmbedLibTorch& primary, int count, int threads, int max_batch,
+                  const std::vector<NumaNode>& nodes) {
+        std::vector<int> per_node(nodes.size(), 0);
+        for (int r = 0; r < count; ++r) per_node[r % nodes.size()] += 1;
+
+        // Frozen (and prepacked) constants cannot be deep-copied per node
+        const bool copy_weights = !primary.frozen();
+        if (!copy_weights) {
+            std::cerr << "Warning: --optimize graphs hold their weights as constants; replicas on all "
+                      << nodes.size() << " NUMA nodes share one copy" << std::endl;
+        }
+
+        for (size_t k = 0; k < nodes.size(); ++k) {
+            if (per_node[k] == 0) continue;
+            const auto& node_cpus = nodes[k].cpus;
+            int node_threads = threads > 0 ? threads : std::max(1, static_cast<int>(node_cpus.size()) / per_node[k]);
+            const bool disjoint = static_cast<size_t>(per_node[k]) * node_threads <= node_cpus.size();
+
+            ArcticEmbedLibTorch* node_weights = nullptr;
+            for (int i = 0; i < per_node[k]; ++i) {
+                auto engine = node_weights ? buildOn(node_cpus, *node_weights, max_batch, false)
+                                           : buildOn(node_cpus, primary, max_batch, copy_weights);
+                if (!node_weights) node_weights = engine.get();
+                replicas_.push_back(engine.get());
+                owned_.push_back(std::move(engine));
+
+                ReplicaPlacement placement;
+                placement.threads = node_threads;
+                placement.node = nodes[k].id;
+                if (disjoint) {
+                    placement.cpus.assign(node_cpus.begin() + i * node_threads,
+                                          node_cpus.begin() + (i + 1) * node_threads);
+                } else {
+                    placement.cpus = node_cpus;
+                }
+                placement_.push_back(std::move(placement));
+            }
+        }
+    }
+
+public:
+    // Single, unpinned replica: the engine as it runs without --replicas
+    explicit ReplicaPool(ArcticEmbedLibTorch& engine) : primary_(&engine) {
+        replicas_.push_back(&engine);
+        placement_.emplace_back();
+    }
+
+    // `count` replicas with `threads` intra-op threads each (0 = split the
+    // CPUs evenly). With more than one NUMA node in `nodes`, replicas and
+    // their weights are placed per node; otherwise they are pinned to
+    // consecutive disjoint core sets of `cpus` when those suffice (unpinned
+    // if not). `cpus` defaults to every CPU the process may use.
+    ReplicaPool(ArcticEmbedLibTorch& primary, int count, int threads, int max_batch,
+                std::vector<int> cpus = {}, const std::vector<NumaNode>& nodes = {})
+        : primary_(&primary) {
+        count = std::max(1, count);
+        if (nodes.size() > 1) {
+            planNuma(primary, count, threads, max_batch, nodes);
+        } else {
+            if (cpus.empty()) cpus = availableCpus();
+            planSingleNode(primary, count, threads, max_batch, cpus);
+        }
+    }
+
+    size_t size() const { return replicas_.size(); }
+    ArcticEmbedLibTorch& replica(size_t i) const { return *replicas_[i]; }
+    ArcticEmbedLibTorch& primary() const { return *primary_; }
+    const ReplicaPlacement& placement(size_t i) const { return placement_[i]; }
+};
+
+// ============================================================================
+// Long-Document Chunking
+// ============================================================================
+
+// Combines per-window vectors (n x dim, already L2-normalized) into one
+// document vector: mean weighted by each window's token count, or
+// element-wise max. The result is L2-normalized again.
+static void aggregateChunks(const float* chunks, const std::vector<size_t>& tokens,
+                            size_t dim, ChunkPooling pooling, float* out) {
+    const size_t n = tokens.size();
+    if (pooling == ChunkPooling::Max) {
+        std::copy(chunks, chunks + dim, out);
+        for (size_t c = 1; c < n; ++c) {
+            const float* row = chunks + c * dim;
+            for (size_t d = 0; d < dim; ++d) out[d] = std::max(out[d], row[d]);
+        }
+    } else {
+        std::fill(out, out + dim, 0.0f);
+        for (size_t c = 0; c < n; ++c) {
+            const float* row = chunks + c * dim;
+            float weight = static_cast<float>(tokens[c]);
+            for (size_t d = 0; d < dim; ++d) out[d] += weight * row[d];
+        }
+    }
+
+    double norm = 0.0;
+    for (size_t d = 0; d < dim; ++d) norm += double(out[d]) * out[d];
+    float inv = norm > 0.0 ? static_cast<float>(1.0 / std::sqrt(norm)) : 0.0f;
+    for (size_t d = 0; d < dim; ++d) out[d] *= inv;
+}
+
+struct ChunkedEmbedding {
+    std::vector<float> document;          // dim
+    std::vector<float> chunks;            // num_chunks x dim
+    std::vector<size_t> chunk_tokens;     // tokens per window (incl. [CLS]/[SEP])
+};
+
+// Embeds a whole document: all windows go through embedBatch (several
+// windows per forward pass) and are pooled into one vector.
+static ChunkedEmbedding embedDocument(const WordPieceTokenizer& tokenizer, ArcticEmbedLibTorch& embedder,
+                                      std::string_view text, const ChunkConfig& config) {
+    std::vector<std::vector<int64_t>> windows;
+    tokenizer.chunkInto(text, config, windows);
+
+    ChunkedEmbedding result;
+    const size_t per_pass = static_cast<size_t>(std::max(1, config.max_windows_per_pass));
+    for (size_t begin = 0; begin < windows.size(); begin += per_pass) {
+        size_t end = std::min(windows.size(), begin + per_pass);
+        std::vector<std::vector<int64_t>> pass(std::make_move_iterator(windows.begin() + begin),
+                                               std::make_move_iterator(windows.begin() + end));
+        for (const auto& ids : pass) result.chunk_tokens.push_back(ids.size());
+        auto vectors = embedder.embedBatch(pass);
+        result.chunks.insert(result.chunks.end(), vectors.begin(), vectors.end());
+    }
+
+    size_t dim = result.chunks.size() / result.chunk_tokens.size();
+    result.document.resize(dim);
+    aggregateChunks(result.chunks.data(), result.chunk_tokens, dim, config.pooling, result.document.data());
+    return result;
+}
+
+// ============================================================================
+// Batch Scheduler (length buckets + token budget + max-wait deadline)
+// ============================================================================
+
+struct SchedulerConfig {
+    // Inclusive upper token bounds; longer sequences go to the last bucket
+    std::vector<int64_t> bucket_bounds = {16, 32, 64, 128, 256, 512};
+    // Cap on padded tokens (rows x longest row) per forward pass
+    int64_t max_batch_tokens = 8192;
+    // A queued request is dispatched at the latest this long after arrival
+    std::chrono::microseconds max_wait{2000};
+    // submit() blocks while this many rows are waiting for a replica
+    size_t max_queued_rows = 65536;
+};
+
+// Groups queued requests by sequence length so that a batch only pads to
+// neighbours of similar size. A bucket is flushed when it holds a full token
+// budget, when its oldest request hits the max-wait deadline, or on stop().
+// Each replica has a worker thread that takes ready batches from the shared
+// buckets and runs them on that replica; no model call happens on the
+// submitting thread.
+class BatchScheduler {
+public:
+    // row == nullptr and error != nullptr on failure
+    using Callback = std::function<void(const float* row, size_t dim, const char* error)>;
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct Pending {
+        std::vector<int64_t> ids;
+        Callback done;
+        Clock::time_point enqueued;
+    };
+
+    struct Bucket {
+        int64_t max_len = 0;
+        std::deque<Pending> queue;
+        int64_t queued_tokens = 0;
+        // Stats
+        uint64_t batches = 0;
+        uint64_t rows = 0;
+        uint64_t tokens = 0;          // real tokens
+        uint64_t padded_tokens = 0;   // rows x padded length
+    };
+
+    // Token-id buffers handed back after a batch, reused by takeBuffer()
+    static constexpr size_t kMaxFreeBuffers = 256;
+
+    struct ReplicaStats {
+        uint64_t batches = 0;
+        uint64_t rows = 0;
+        double busy_ms = 0.0;
+    };
+
+    ReplicaPool& pool_;
+    SchedulerConfig config_;
+    std::vector<Bucket> buckets_;
+    std::vector<ReplicaStats> replica_stats_;
+    std::vector<std::vector<int64_t>> free_buffers_;
+    mutable std::mutex mutex_;
+    std::condition_variable cv_;
+    std::condition_variable space_;   // queued_rows_ dropped below the cap
+    size_t queued_rows_ = 0;
+    bool stopping_ = false;
+    std::vector<std::thread> workers_;
+    Clock::time_point started_ = Clock::now();
+
+    struct NodeStats {
+        int node = -1;
+        int replicas = 0;
+        ReplicaStats stats;
+    };
+
+    // Per-node totals; empty unless the pool placed replicas on NUMA nodes.
+    // Caller holds mutex_.
+    std::vector<NodeStats> nodeStats() const {
+        std::vector<NodeStats> nodes;
+        for (size_t r = 0; r < replica_stats_.size(); ++r) {
+            int id = pool_.placement(r).node;
+            if (id < 0) continue;
+            auto it = std::find_if(nodes.begin(), nodes.end(), [id](const NodeStats& n) { return n.node == id; });
+            if (it == nodes.end()) {
+                nodes.emplace_back();
+                it = nodes.end() - 1;
+                it->node = id;
+            }
+            it->replicas += 1;
+            it->stats.batches += replica_stats_[r].batches;
+            it->stats.rows += replica_stats_[r].rows;
+            it->stats.busy_ms += replica_stats_[r].busy_ms;
+        }
+        return nodes;
+    }
+
+    size_t bucketFor(size_t len) const {
+        for (size_t b = 0; b < buckets_.size(); ++b) {
+            if (static_cast<int64_t>(len) <= buckets_[b].max_len) return b;
+        }
+        return buckets_.size() - 1;
+    }
+
+    void execute(size_t replica, std::vector<Pending>& batch, size_t bucket_idx, int64_t padded_len) {
+        std::vector<std::vector<int64_t>> ids;
+        ids.reserve(batch.size());
+        int64_t real_tokens = 0;
+        for (auto& p : batch) {
+            real_tokens += static_cast<int64_t>(p.ids.size());
+            ids.push_back(std::move(p.ids));
+        }
+
+        auto start = Clock::now();
+        try {
+            auto embeddings = pool_.replica(replica).embedBatch(ids, /*lookup_cache=*/false);
+            size_t dim = embeddings.size() / batch.size();
+            for (size_t i = 0; i < batch.size(); ++i) {
+                batch[i].done(embeddings.data() + i * dim, dim, nullptr);
+            }
+        } catch (const std::exception& e) {
+            for (auto& p : batch) p.done(nullptr, 0, e.what());
+        }
+        double busy_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& buffer : ids) {
+            if (free_buffers_.size() >= kMaxFreeBuffers) break;
+            free_buffers_.push_back(std::move(buffer));
+        }
+        auto& bucket = buckets_[bucket_idx];
+        bucket.batches += 1;
+        bucket.rows += batch.size();
+        bucket.tokens += real_tokens;
+        bucket.padded_tokens += padded_len * batch.size();
+        auto& stats = replica_stats_[replica];
+        stats.batches += 1;
+        stats.rows += batch.size();
+        stats.busy_ms += busy_ms;
+    }
+
+    // One worker per replica; an idle worker takes the next ready batch, so
+    // requests go to whichever replica is free
+    void run(size_t replica) {
+        // OpenMP thread counts are per-thread; pick up the configured value
+        applyPlacement(pool_.placement(replica));
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            auto now = Clock::now();
+            int ready = -1;
+            auto next_deadline = Clock::time_point::max();
+
+            for (size_t b = 0; b < buckets_.size(); ++b) {
+                const auto& q = buckets_[b].queue;
+                if (q.empty()) continue;
+                auto deadline = q.front().enqueued + config_.max_wait;
+                bool full = buckets_[b].queued_tokens >= config_.max_batch_tokens;
+                if (stopping_ || full || deadline <= now) {
+                    // Most overdue bucket first
+                    if (ready < 0 || q.front().enqueued < buckets_[ready].queue.front().enqueued) {
+                        ready = static_cast<int>(b);
+                    }
+                } else {
+                    next_deadline = std::min(next_deadline, deadline);
+                }
+            }
+
+            if (ready < 0) {
+                if (stopping_) break;
+                if (next_deadline == Clock::time_point::max()) {
+                    cv_.wait(lock);
+                } else {
+                    cv_.wait_until(lock, next_deadline);
+                }
+                continue;
+            }
+
+            // Take rows while the padded batch stays within the token budget
+            auto& bucket = buckets_[ready];
+            std::vector<Pending> batch;
+            int64_t padded_len = 0;
+            while (!bucket.queue.empty()) {
+                int64_t len = static_cast<int64_t>(bucket.queue.front().ids.size());
+                int64_t next_len = std::max(padded_len, len);
+                if (!batch.empty() && next_len * static_cast<int64_t>(batch.size() + 1) > config_.max_batch_tokens) {
+                    break;
+                }
+                padded_len = next_len;
+                bucket.queued_tokens -= len;
+                batch.push_back(std::move(bucket.queue.front()));
+                bucket.queue.pop_front();
+            }
+
+            queued_rows_ -= batch.size();
+            space_.notify_all();
+            // Let another idle worker look at what is left
+            if (pool_.size() > 1) cv_.notify_one();
+            lock.unlock();
+            execute(replica, batch, ready, padded_len);
+            lock.lock();
+        }
+    }
+
+public:
+    BatchScheduler(ReplicaPool& pool, SchedulerConfig config)
+        : pool_(pool), config_(std::move(config)), replica_stats_(pool.size()) {
+        if (config_.bucket_bounds.empty()) config_.bucket_bounds.push_back(512);
+        std::sort(config_.bucket_bounds.begin(), config_.bucket_bounds.end());
+        for (auto bound : config_.bucket_bounds) {
+            Bucket bucket;
+            bucket.max_len = bound;
+            buckets_.push_back(std::move(bucket));
+        }
+        for (size_t r = 0; r < pool_.size(); ++r) {
+            workers_.emplace_back([this, r] { run(r); });
+        }
+    }
+
+    ~BatchScheduler() { stop(); }
+
+    void recycle(std::vector<int64_t> buffer) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_buffers_.size() < kMaxFreeBuffers) free_buffers_.push_back(std::move(buffer));
+    }
+
+    // Returns a recycled token-id buffer (capacity kept) so the steady-state
+    // tokenize -> submit cycle does not allocate
+    std::vector<int64_t> takeBuffer() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (free_buffers_.empty()) return {};
+        auto buffer = std::move(free_buffers_.back());
+        free_buffers_.pop_back();
+        return buffer;
+    }
+
+    // Blocks while max_queued_rows rows are already waiting, so producers
+    // cannot queue work faster than the replicas retire it
+    void submit(std::vector<int64_t> ids, Callback done) {
+        // Cache hits skip the queue (and the max-wait deadline) entirely
+        ArcticEmbedLibTorch& primary = pool_.primary();
+        if (primary.hasCache()) {
+            thread_local std::vector<float> row;
+            row.resize(primary.dim());
+            if (primary.lookupCached(ids, row.data())) {
+                done(row.data(), row.size(), nullptr);
+                recycle(std::move(ids));
+                return;
+            }
+        }
+
+        {
+            std::unique_lock<std::mutex> lock(mutex_);
+            space_.wait(lock, [&] { return stopping_ || queued_rows_ < config_.max_queued_rows; });
+            queued_rows_ += 1;
+            auto& bucket = buckets_[bucketFor(ids.size())];
+            bucket.queued_tokens += static_cast<int64_t>(ids.size());
+            bucket.queue.push_back({std::move(ids), std::move(done), Clock::now()});
+        }
+        cv_.notify_one();
+    }
+
+    // Flushes everything still queued, then joins the workers
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        cv_.notify_all();
+        space_.notify_all();
+        for (auto& worker : workers_) {
+            if (worker.joinable()) worker.join();
+        }
+    }
+
+    std::string statsJson() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        std::ostringstream os;
+        os << "{\"buckets\":[";
+        for (size_t b = 0; b < buckets_.size(); ++b) {
+            const auto& bucket = buckets_[b];
+            double efficiency = bucket.padded_tokens ? double(bucket.tokens) / bucket.padded_tokens : 1.0;
+            if (b > 0) os << ",";
+            os << "{\"max_len\":" << bucket.max_len
+               << ",\"batches\":" << bucket.batches
+               << ",\"rows\":" << bucket.rows
+               << ",\"tokens\":" << bucket.tokens
+               << ",\"padded_tokens\":" << bucket.padded_tokens
+               << ",\"padding_efficiency\":" << std::setprecision(4) << efficiency << "}";
+        }
+        os << "],\"replicas\":[";
+        for (size_t r = 0; r < replica_stats_.size(); ++r) {
+            const auto& stats = replica_stats_[r];
+            const auto& placement = pool_.placement(r);
+            if (r > 0) os << ",";
+            os << "{\"cpus\":\"" << formatCpuList(placement.cpus) << "\""
+               << ",\"node\":" << placement.node
+               << ",\"threads\":" << placement.threads
+               << ",\"batches\":" << stats.batches
+               << ",\"rows\":" << stats.rows
+               << ",\"busy_ms\":" << std::setprecision(6) << stats.busy_ms << "}";
+        }
+        os << "]";
+        auto nodes = nodeStats();
+        if (!nodes.empty()) {
+            double uptime_s = std::chrono::duration<double>(Clock::now() - started_).count();
+            os << ",\"nodes\":[";
+            for (size_t k = 0; k < nodes.size(); ++k) {
+                const auto& node = nodes[k];
+                if (k > 0) os << ",";
+                os << "{\"node\":" << node.node
+                   << ",\"replicas\":" << node.replicas
+                   << ",\"batches\":" << node.stats.batches
+                   << ",\"rows\":" << node.stats.rows
+                   << ",\"busy_ms\":" << std::setprecision(6) << node.stats.busy_ms
+                   << ",\"rows_per_s\":" << std::setprecision(6)
+                   << (uptime_s > 0.0 ? node.stats.rows / uptime_s : 0.0) << "}";
+            }
+            os << "]";
+        }
+        pool_.primary().writeCacheStats(os);
+        os << "}";
+        return os.str();
+    }
+
+    void printReport(std::ostream& os) const {
+        pool_.primary().printCacheReport(os);
+        std::lock_guard<std::mutex> lock(mutex_);
+        os << "Scheduler buckets (padding efficiency = real / padded tokens):" << std::endl;
+        for (const auto& bucket : buckets_) {
+            if (bucket.batches == 0) continue;
+            double efficiency = double(bucket.tokens) / bucket.padded_tokens;
+            os << "  <= " << std::setw(4) << bucket.max_len << " tokens: "
+               << bucket.batches << " batches, " << bucket.rows << " rows, "
+               << std::fixed << std::setprecision(1) << efficiency * 100.0 << "% efficiency, "
+               << double(bucket.rows) / bucket.batches << " rows/batch"
+               << std::defaultfloat << std::endl;
+        }
+        if (replica_stats_.size() > 1) {
+            os << "Replicas:" << std::endl;
+            for (size_t r = 0; r < replica_stats_.size(); ++r) {
+                const auto& stats = replica_stats_[r];
+                os << "  #" << r << " cpus " << formatCpuList(pool_.placement(r).cpus)
+                   << (pool_.placement(r).node >= 0 ? " (node " + std::to_string(pool_.placement(r).node) + ")" : "")
+                   << ", " << pool_.placement(r).threads << " threads: "
+                   << stats.batches << " batches, " << stats.rows << " rows, "
+                   << std::fixed << std::setprecision(1) << stats.busy_ms << " ms busy"
+                   << std::defaultfloat << std::endl;
+            }
+        }
+        auto nodes = nodeStats();
+        if (!nodes.empty()) {
+            double uptime_s = std::chrono::duration<double>(Clock::now() - started_).count();
+            os << "NUMA nodes:" << std::endl;
+            for (const auto& node : nodes) {
+                os << "  node " << node.node << ": " << node.replicas << " replicas, "
+                   << node.stats.batches << " batches, " << node.stats.rows << " rows, "
+                   << std::fixed << std::setprecision(1)
+                   << (uptime_s > 0.0 ? node.stats.rows / uptime_s : 0.0) << " rows/s"
+                   << std::defaultfloat << std::endl;
+            }
+        }
+    }
+};
+
+// ============================================================================
+// JSON Helpers (server protocol)
+// ============================================================================
+
+// Minimal reader for the flat request objects used by --serve. Anything it
+// does not understand is skipped; malformed input throws std::runtime_error.
+class JsonReader {
+private:
+    const std::string& src_;
+    size_t pos_ = 0;
+
+    [[noreturn]] void fail(const char* what) const {
+        throw std::runtime_error(std::string("invalid JSON: ") + what +
+                                 " at offset " + std::to_string(pos_));
+    }
+
+    static void appendUtf8(std::string& out, uint32_t cp) {
+        if (cp < 0x80) {
+            out += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            out += static_cast<char>(0xC0 | (cp >> 6));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            out += static_cast<char>(0xE0 | (cp >> 12));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            out += static_cast<char>(0xF0 | (cp >> 18));
+            out += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            out += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            out += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+    }
+
+    uint32_t parseHex4() {
+        if (pos_ + 4 > src_.size()) fail("truncated \\u escape");
+        uint32_t v = 0;
+        for (int i = 0; i < 4; ++i) {
+            char c = src_[pos_++];
+            v <<= 4;
+            if (c >= '0' && c <= '9') v |= c - '0';
+            else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+            else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+            else fail("bad \\u escape");
+        }
+        return v;
+    }
+
+public:
+    explicit JsonReader(const std::string& src) : src_(src) {}
+
+    void skipWs() {
+        while (pos_ < src_.size() &&
+               (src_[pos_] == ' ' || src_[pos_] == '\t' || src_[pos_] == '\n' || src_[pos_] == '\r')) {
+            ++pos_;
+        }
+    }
+
+    char peek() {
+        skipWs();
+        return pos_ < src_.size() ? src_[pos_] : '\0';
+    }
+
+    void expect(char c) {
+        if (peek() != c) fail("unexpected character");
+        ++pos_;
+    }
+
+    bool consume(char c) {
+        if (peek() != c) return false;
+        ++pos_;
+        return true;
+    }
+
+    bool atEnd() { return peek() == '\0'; }
+
+    void parseString(std::string& out) {
+        expect('"');
+        out.clear();
+        while (true) {
+            if (pos_ >= src_.size()) fail("unterminated string");
+            char c = src_[pos_++];
+            if (c == '"') return;
+            if (c != '\\') {
+                out += c;
+                continue;
+            }
+            if (pos_ >= src_.size()) fail("unterminated escape");
+            char e = src_[pos_++];
+            switch (e) {
+                case '"':  out += '"';  break;
+                case '\\': out += '\\'; break;
+                case '/':  out += '/';  break;
+                case 'b':  out += '\b'; break;
+                case 'f':  out += '\f'; break;
+                case 'n':  out += '\n'; break;
+                case 'r':  out += '\r'; break;
+                case 't':  out += '\t'; break;
+                case 'u': {
+                    uint32_t cp = parseHex4();
+                    // Surrogate pair
+                    if (cp >= 0xD800 && cp <= 0xDBFF && pos_ + 1 < src_.size() &&
+                        src_[pos_] == '\\' && src_[pos_ + 1] == 'u') {
+                        pos_ += 2;
+                        uint32_t lo = parseHex4();
+                        if (lo >= 0xDC00 && lo <= 0xDFFF) {
+                            cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+                        } else {
+                            appendUtf8(out, 0xFFFD);
+                            cp = lo;
+                        }
+                    }
+                    if (cp >= 0xD800 && cp <= 0xDFFF) cp = 0xFFFD;
+                    appendUtf8(out, cp);
+                    break;
+                }
+                default: fail("bad escape");
+            }
+        }
+    }
+
+    // Returns the raw source text of the next value (used to echo ids verbatim)
+    std::string rawValue() {
+        skipWs();
+        size_t begin = pos_;
+        skipValue();
+        return src_.substr(begin, pos_ - begin);
+    }
+
+    void skipValue() {
+        char c = peek();
+        if (c == '"') {
+            std::string tmp;
+            parseString(tmp);
+        } else if (c == '{' || c == '[') {
+            char close = (c == '{') ? '}' : ']';
+            ++pos_;
+            if (consume(close)) return;
+            do {
+                if (close == '}') {
+                    std::string key;
+                    parseString(key);
+                    expect(':');
+                }
+                skipValue();
+            } while (consume(','));
+            expect(close);
+        } else {
+            size_t begin = pos_;
+            while (pos_ < src_.size() && std::string(",}] \t\r\n").find(src_[pos_]) == std::string::npos) {
+                ++pos_;
+            }
+            if (pos_ == begin) fail("expected value");
+        }
+    }
+};
+
+static void appendJsonString(std::string& out, const std::string& s) {
+    static const char* hex = "0123456789abcdef";
+    out += '"';
+    for (unsigned char c : s) {
+        switch (c) {
+            case '"':  out += "\\\""; break;
+            case '\\': out += "\\\\"; break;
+            case '\n': out += "\\n";  break;
+            case '\r': out += "\\r";  break;
+            case '\t': out += "\\t";  break;
+            default:
+                if (c < 0x20) {
+                    out += "\\u00";
+                    out += hex[c >> 4];
+                    out += hex[c & 0xF];
+                } else {
+                    out += static_cast<char>(c);
+                }
+        }
+    }
+    out += '"';
+}
+
+// Longest shortest-round-trip float: "-1.17549435e-38" (15) plus a comma
+constexpr size_t kMaxJsonFloatChars = 16;
+
+// Floating-point std::to_chars needs libstdc++ 11 or, on Apple, a macOS 13.3
+// deployment target; without it floats are printed with 9 significant
+// digits, which also round-trip (just not in the shortest form). The process
+// never calls setlocale(), so "%g" uses '.'.
+#ifdef __cpp_lib_to_chars
+constexpr const char* kJsonFloatWriter = "to_chars shortest";
+static char* writeJsonFloat(char* p, char* end, float v) {
+    return std::to_chars(p, end, v).ptr;
+}
+#else
+constexpr const char* kJsonFloatWriter = "snprintf %.9g";
+static char* writeJsonFloat(char* p, char* end, float v) {
+    return p + std::snprintf(p, static_cast<size_t>(end - p), "%.9g", static_cast<double>(v));
+}
+#endif
+
+// Appends a vector as a JSON array. Each float is written in its shortest
+// form that parses back to the same float (locale-free, and usually fewer
+// digits than the fixed 8 significant ones). Non-finite values have no JSON
+// spelling and become null.
+static void appendEmbeddingJson(std::string& out, const float* data, size_t n) {
+    size_t offset = out.size();
+    out.resize(offset + 2 + n * kMaxJsonFloatChars);
+    char* p = &out[offset];
+    char* const end = out.data() + out.size();
+    *p++ = '[';
+    for (size_t i = 0; i < n; ++i) {
+        if (i > 0) *p++ = ',';
+        if (std::isfinite(data[i])) {
+            p = writeJsonFloat(p, end, data[i]);
+        } else {
+            std::memcpy(p, "null", 4);
+            p += 4;
+        }
+    }
+    *p++ = ']';
+    out.resize(static_cast<size_t>(p - out.data()));
+}
+
+static void appendUnsignedJson(std::string& out, uint64_t v) {
+    char buf[20];
+    out.append(buf, static_cast<size_t>(std::to_chars(buf, buf + sizeof(buf), v).ptr - buf));
+}
+
+// {"embedding":[...],"chunks":[[...],...],"chunk_tokens":[...]} for --chunk-vectors
+static void appendChunkedJson(std::string& out, const ChunkedEmbedding& result) {
+    size_t dim = result.document.size();
+    out.reserve(out.size() + (result.chunk_tokens.size() + 1) * (dim * kMaxJsonFloatChars + 3) + 64);
+    out += "{\"embedding\":";
+    appendEmbeddingJson(out, result.document.data(), dim);
+    out += ",\"chunks\":[";
+    for (size_t c = 0; c < result.chunk_tokens.size(); ++c) {
+        if (c > 0) out += ',';
+        appendEmbeddingJson(out, result.chunks.data() + c * dim, dim);
+    }
+    out += "],\"chunk_tokens\":[";
+    for (size_t c = 0; c < result.chunk_tokens.size(); ++c) {
+        if (c > 0) out += ',';
+        appendUnsignedJson(out, result.chunk_tokens[c]);
+    }
+    out += "]}";
+}
+
+// Writes all of `data` with write(2), retrying short writes; false on error
+static bool writeFully(int fd, const char* data, size_t n) {
+    while (n > 0) {
+        ssize_t written = ::write(fd, data, n);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        data += written;
+        n -= static_cast<size_t>(written);
+    }
+    return true;
+}
+
+// Emits finished output on stdout in one write(2), after anything still
+// buffered in std::cout
+static void writeStdout(const std::string& data) {
+    std::cout.flush();
+    if (!writeFully(STDOUT_FILENO, data.data(), data.size())) {
+        throw std::runtime_error(std::string("write to stdout failed: ") + std::strerror(errno));
+    }
+}
+
+// ============================================================================
+// Binary Output Formats (--format)
+// ============================================================================
+
+// One-shot output without text floats: a 16-byte header followed by
+// count x dim little-endian values, row-major.
+//   f32le       header + float32 rows
+//   f16le       header + IEEE half rows (round to nearest even)
+//   base64-f32  the f32le bytes, base64-encoded, one line
+// The header is reused by the bulk pipeline's output file (--output).
+enum class OutputFormat { Json, F32LE, F16LE, Base64F32 };
+
+enum class VectorDtype : uint8_t { F32 = 1, F16 = 2 };
+
+struct EmbeddingFileHeader {
+    char magic[4];       // "AEMB"
+    uint8_t version;     // 1
+    uint8_t dtype;       // VectorDtype
+    uint16_t reserved;
+    uint32_t count;
+    uint32_t dim;
+};
+static_assert(sizeof(EmbeddingFileHeader) == 16, "embedding header layout");
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "binary output assumes a little-endian host");
+
+static OutputFormat parseOutputFormat(const std::string& name) {
+    if (name == "json") return OutputFormat::Json;
+    if (name == "f32le") return OutputFormat::F32LE;
+    if (name == "f16le") return OutputFormat::F16LE;
+    if (name == "base64-f32") return OutputFormat::Base64F32;
+    throw std::invalid_argument("unknown format '" + name + "' (expected json, f32le, f16le or base64-f32)");
+}
+
+static EmbeddingFileHeader makeEmbeddingHeader(VectorDtype dtype, size_t count, size_t dim) {
+    EmbeddingFileHeader header{};
+    std::memcpy(header.magic, "AEMB", 4);
+    header.version = 1;
+    header.dtype = static_cast<uint8_t>(dtype);
+    header.count = static_cast<uint32_t>(count);
+    header.dim = static_cast<uint32_t>(dim);
+    return header;
+}
+
+static size_t dtypeBytes(VectorDtype dtype) {
+    return dtype == VectorDtype::F16 ? 2 : 4;
+}
+
+// float -> IEEE 754 binary16, round to nearest even; overflow goes to inf,
+// NaN stays NaN, tiny values become subnormals or signed zero
+static uint16_t floatToHalf(float value) {
+    uint32_t f;
+    std::memcpy(&f, &value, sizeof(f));
+    const uint16_t sign = static_cast<uint16_t>((f >> 16) & 0x8000);
+    const uint32_t abs = f & 0x7FFFFFFF;
+
+    if (abs >= 0x7F800000) {                       // inf / NaN
+        return sign | 0x7C00 | (abs > 0x7F800000 ? 0x0200 : 0);
+    }
+    if (abs >= 0x477FF000) return sign | 0x7C00;  // rounds past 65504
+    if (abs < 0x38800000) {                        // below 2^-14: subnormal
+        if (abs < 0x33000000) return sign;         // below half the smallest subnormal
+        const uint32_t exp = abs >> 23;
+        const uint32_t mant = (abs & 0x7FFFFF) | 0x800000;
+        const uint32_t shift = 126 - exp;          // 14..24
+        uint32_t half = mant >> shift;
+        const uint32_t rest = mant & ((1u << shift) - 1);
+        const uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half += 1;
+        return sign | static_cast<uint16_t>(half);
+    }
+    uint32_t half = ((abs >> 13) - (112u << 10));  // rebias 127 -> 15
+    const uint32_t rest = abs & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half += 1;
+    return sign | static_cast<uint16_t>(half);
+}
+
+// Appends n values in `dtype`
+static void appendVectorData(std::string& out, const float* data, size_t n, VectorDtype dtype) {
+    if (dtype == VectorDtype::F32) {
+        out.append(reinterpret_cast<const char*>(data), n * sizeof(float));
+        return;
+    }
+    size_t offset = out.size();
+    out.resize(offset + n * sizeof(uint16_t));
+    char* dst = &out[offset];
+    for (size_t i = 0; i < n; ++i) {
+        uint16_t h = floatToHalf(data[i]);
+        std::memcpy(dst + i * sizeof(h), &h, sizeof(h));
+    }
+}
+
+static void appendBase64(std::string& out, const char* data, size_t n) {
+    static const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+    const auto* p = reinterpret_cast<const unsigned char*>(data);
+    out.reserve(out.size() + (n + 2) / 3 * 4);
+    size_t i = 0;
+    for (; i + 3 <= n; i += 3) {
+        uint32_t v = (uint32_t(p[i]) << 16) | (uint32_t(p[i + 1]) << 8) | p[i + 2];
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 63];
+        out += alphabet[(v >> 6) & 63];
+        out += alphabet[v & 63];
+    }
+    if (i < n) {
+        uint32_t v = uint32_t(p[i]) << 16;
+        if (i + 1 < n) v |= uint32_t(p[i + 1]) << 8;
+        out += alphabet[v >> 18];
+        out += alphabet[(v >> 12) & 63];
+        out += i + 1 < n ? alphabet[(v >> 6) & 63] : '=';
+        out += '=';
+    }
+}
+
+// Appends count x dim rows in a binary format (not Json): header + rows, or
+// their base64 line
+static void appendEmbeddingsBinary(std::string& out, OutputFormat format, const float* rows, size_t count, size_t dim) {
+    const VectorDtype dtype = format == OutputFormat::F16LE ? VectorDtype::F16 : VectorDtype::F32;
+    const EmbeddingFileHeader header = makeEmbeddingHeader(dtype, count, dim);
+    std::string bytes(reinterpret_cast<const char*>(&header), sizeof(header));
+    bytes.reserve(sizeof(header) + count * dim * dtypeBytes(dtype));
+    appendVectorData(bytes, rows, count * dim, dtype);
+
+    if (format == OutputFormat::Base64F32) {
+        appendBase64(out, bytes.data(), bytes.size());
+        out += '\n';
+    } else {
+        out += bytes;
+    }
+}
+
+// One-shot output of a single vector, in one write
+static void writeOneShot(OutputFormat format, const float* embedding, size_t dim) {
+    std::string out;
+    if (format == OutputFormat::Json) {
+        appendEmbeddingJson(out, embedding, dim);
+        out += '\n';
+    } else {
+        appendEmbeddingsBinary(out, format, embedding, 1, dim);
+    }
+    writeStdout(out);
+}
+
+// One-shot output of a chunked document; with `with_chunks` the binary forms
+// carry the document vector followed by the window vectors (count = 1 + windows)
+static void writeOneShot(OutputFormat format, const ChunkedEmbedding& result, bool with_chunks) {
+    const size_t dim = result.document.size();
+    std::string out;
+    if (format == OutputFormat::Json) {
+        if (with_chunks) {
+            appendChunkedJson(out, result);
+        } else {
+            appendEmbeddingJson(out, result.document.data(), dim);
+        }
+        out += '\n';
+    } else if (with_chunks) {
+        std::vector<float> rows(result.document);
+        rows.insert(rows.end(), result.chunks.begin(), result.chunks.end());
+        appendEmbeddingsBinary(out, format, rows.data(), 1 + result.chunk_tokens.size(), dim);
+    } else {
+        appendEmbeddingsBinary(out, format, result.document.data(), 1, dim);
+    }
+    writeStdout(out);
+}
+
+// ============================================================================
+// Server Mode (--serve)
+// ============================================================================
+
+// One request per line on stdin:
+//   {"id": 1, "text": "hello"}             -> {"id":1,"embedding":[...]}
+//   {"id": "a", "texts": ["x", "y"]}       -> {"id":"a","embeddings":[[...],[...]]}
+//   {"id": 2, "stats": true}               -> {"id":2,"stats":{"buckets":[...]}}
+// Adding "chunk": true embeds the whole text via overlapping windows instead of
+// truncating at 512 tokens; "chunk_vectors": true also returns the windows
+// ("chunks" / "chunk_tokens", one list per text for the "texts" form).
+// Texts are queued on the BatchScheduler, so responses may come back out of
+// order; match them by id. Failures are reported per request as
+// {"id":...,"error":"..."}; the process keeps serving until stdin is closed.
+struct ServeRequest {
+    std::string id = "null";   // raw JSON, echoed back verbatim
+    std::vector<std::string> texts;
+    bool batch = false;        // "texts" form -> "embeddings" response
+    bool stats = false;
+    bool chunk = false;
+    bool chunk_vectors = false;
+};
+
+static ServeRequest parseServeRequest(const std::string& line, std::string& id_out) {
+    ServeRequest req;
+    JsonReader reader(line);
+    bool have_text = false;
+
+    reader.expect('{');
+    if (!reader.consume('}')) {
+        do {
+            std::string key;
+            reader.parseString(key);
+            reader.expect(':');
+            if (key == "id") {
+                req.id = reader.rawValue();
+                id_out = req.id;
+            } else if (key == "text") {
+                req.texts.emplace_back();
+                reader.parseString(req.texts.back());
+                have_text = true;
+            } else if (key == "texts") {
+                req.batch = true;
+                have_text = true;
+                reader.expect('[');
+                if (!reader.consume(']')) {
+                    do {
+                        req.texts.emplace_back();
+                        reader.parseString(req.texts.back());
+                    } while (reader.consume(','));
+                    reader.expect(']');
+                }
+            } else if (key == "stats") {
+                req.stats = reader.rawValue() == "true";
+            } else if (key == "chunk") {
+                req.chunk = reader.rawValue() == "true";
+            } else if (key == "chunk_vectors") {
+                req.chunk_vectors = reader.rawValue() == "true";
+            } else {
+                reader.skipValue();
+            }
+        } while (reader.consume(','));
+        reader.expect('}');
+    }
+    if (!reader.atEnd()) throw std::runtime_error("invalid JSON: trailing data");
+    if (!have_text && !req.stats) throw std::runtime_error("request needs \"text\" or \"texts\"");
+    return req;
+}
+
+// Collects the rows of one request as they complete on the scheduler thread.
+// Without chunking there is one row per text; with chunking, text t owns rows
+// text_rows[t] .. text_rows[t + 1].
+struct PendingResponse {
+    std::string id;
+    bool batch = false;
+    bool chunk = false;
+    bool chunk_vectors = false;
+    std::vector<std::vector<float>> rows;
+    std::vector<size_t> row_tokens;
+    std::vector<size_t> text_rows;
+    size_t remaining = 0;
+    std::string error;
+    std::mutex mutex;
+};
+
+// Pools the window rows of one text of a chunked request
+static ChunkedEmbedding collectChunks(const PendingResponse& resp, size_t text, ChunkPooling pooling) {
+    ChunkedEmbedding result;
+    for (size_t r = resp.text_rows[text]; r < resp.text_rows[text + 1]; ++r) {
+        result.chunks.insert(result.chunks.end(), resp.rows[r].begin(), resp.rows[r].end());
+        result.chunk_tokens.push_back(resp.row_tokens[r]);
+    }
+    size_t dim = resp.rows[resp.text_rows[text]].size();
+    result.document.resize(dim);
+    aggregateChunks(result.chunks.data(), result.chunk_tokens, dim, pooling, result.document.data());
+    return result;
+}
+
+class ServeOutput {
+private:
+    std::mutex mutex_;
+    ChunkPooling pooling_;
+
+public:
+    explicit ServeOutput(ChunkPooling pooling) : pooling_(pooling) {}
+
+    // One write(2) per newline-terminated line; the mutex keeps concurrent
+    // completions whole
+    void writeLine(const std::string& line) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        writeFully(STDOUT_FILENO, line.data(), line.size());
+    }
+
+    void writeError(const std::string& id, const std::string& message) {
+        std::string line = "{\"id\":" + id + ",\"error\":";
+        appendJsonString(line, message);
+        line += "}\n";
+        writeLine(line);
+    }
+
+    void writeResponse(const PendingResponse& resp) {
+        if (!resp.error.empty()) {
+            writeError(resp.id, resp.error);
+            return;
+        }
+        // Per-thread response buffer: sized once for the largest response
+        // this worker has written, then reused
+        thread_local std::string out;
+        out.clear();
+        out += "{\"id\":";
+        out += resp.id;
+        out += resp.batch ? ",\"embeddings\":[" : ",\"embedding\":";
+        if (!resp.chunk) {
+            size_t floats = 0;
+            for (const auto& row : resp.rows) floats += row.size();
+            out.reserve(out.size() + floats * kMaxJsonFloatChars + resp.rows.size() * 3 + 4);
+            for (size_t i = 0; i < resp.rows.size(); ++i) {
+                if (i > 0) out += ',';
+                appendEmbeddingJson(out, resp.rows[i].data(), resp.rows[i].size());
+            }
+            out += resp.batch ? "]}\n" : "}\n";
+            writeLine(out);
+            return;
+        }
+
+        std::vector<ChunkedEmbedding> docs;
+        for (size_t t = 0; t + 1 < resp.text_rows.size(); ++t) {
+            docs.push_back(collectChunks(resp, t, pooling_));
+            if (t > 0) out += ',';
+            appendEmbeddingJson(out, docs.back().document.data(), docs.back().document.size());
+        }
+        if (resp.batch) out += ']';
+        if (resp.chunk_vectors) {
+            out += ",\"chunks\":";
+            if (resp.batch) out += '[';
+            for (size_t t = 0; t < docs.size(); ++t) {
+                size_t dim = docs[t].document.size();
+                if (t > 0) out += ',';
+                out += '[';
+                for (size_t c = 0; c < docs[t].chunk_tokens.size(); ++c) {
+                    if (c > 0) out += ',';
+                    appendEmbeddingJson(out, docs[t].chunks.data() + c * dim, dim);
+                }
+                out += ']';
+            }
+            if (resp.batch) out += ']';
+            out += ",\"chunk_tokens\":";
+            if (resp.batch) out += '[';
+            for (size_t t = 0; t < docs.size(); ++t) {
+                if (t > 0) out += ',';
+                out += '[';
+                for (size_t c = 0; c < docs[t].chunk_tokens.size(); ++c) {
+                    if (c > 0) out += ',';
+                    appendUnsignedJson(out, docs[t].chunk_tokens[c]);
+                }
+                out += ']';
+            }
+            if (resp.batch) out += ']';
+        }
+        out += "}\n";
+        writeLine(out);
+    }
+};
+
+// Tokenizes every text of a request (windows when resp.chunk is set) and
+// records the row layout in `resp`, so the row count is known before the
+// first completion can arrive
+static std::vector<std::vector<int64_t>> tokenizeRequest(WordPieceTokenizer& tokenizer, BatchScheduler& scheduler,
+                                                         const ChunkConfig& chunk_config,
+                                                         const std::vector<std::string>& texts, PendingResponse& resp) {
+    thread_local std::vector<std::vector<int64_t>> windows;
+    std::vector<std::vector<int64_t>> row_ids;
+    resp.text_rows.push_back(0);
+    for (const auto& text : texts) {
+        if (resp.chunk) {
+            tokenizer.chunkInto(text, chunk_config, windows);
+            for (auto& window : windows) row_ids.push_back(std::move(window));
+        } else {
+            row_ids.push_back(scheduler.takeBuffer());
+            tokenizer.tokenizeInto(text, row_ids.back());
+        }
+        resp.text_rows.push_back(row_ids.size());
+    }
+    for (const auto& ids : row_ids) resp.row_tokens.push_back(ids.size());
+    resp.rows.resize(row_ids.size());
+    resp.remaining = row_ids.size();
+    return row_ids;
+}
+
+// Queues the rows; `complete` runs once, after the last row (immediately
+// when there are none), on whichever thread finished it
+static void submitRows(BatchScheduler& scheduler, std::vector<std::vector<int64_t>>& row_ids,
+                       const std::shared_ptr<PendingResponse>& resp, std::function<void()> complete) {
+    if (row_ids.empty()) {
+        complete();
+        return;
+    }
+    auto on_complete = std::make_shared<std::function<void()>>(std::move(complete));
+    for (size_t i = 0; i < row_ids.size(); ++i) {
+        scheduler.submit(std::move(row_ids[i]),
+            [resp, i, on_complete](const float* row, size_t dim, const char* error) {
+                bool done;
+                {
+                    std::lock_guard<std::mutex> lock(resp->mutex);
+                    if (error) {
+                        if (resp->error.empty()) resp->error = error;
+                    } else {
+                        resp->rows[i].assign(row, row + dim);
+                    }
+                    done = --resp->remaining == 0;
+                }
+                if (done) (*on_complete)();
+            });
+    }
+}
+
+static int runServer(WordPieceTokenizer& tokenizer, BatchScheduler& scheduler, const ChunkConfig& chunk_config) {
+    ServeOutput output(chunk_config.pooling);
+    std::cerr << "Ready (serving NDJSON on stdin)" << std::endl;
+
+    std::string line;
+    while (std::getline(std::cin, line)) {
+        if (line.find_first_not_of(" \t\r") == std::string::npos) continue;
+
+        std::string id = "null";
+        try {
+            auto req = parseServeRequest(line, id);
+
+            if (req.stats) {
+                output.writeLine("{\"id\":" + req.id + ",\"stats\":" + scheduler.statsJson() + "}\n");
+                continue;
+            }
+
+            auto resp = std::make_shared<PendingResponse>();
+            resp->id = req.id;
+            resp->batch = req.batch;
+            resp->chunk = req.chunk;
+            resp->chunk_vectors = req.chunk_vectors;
+
+            auto row_ids = tokenizeRequest(tokenizer, scheduler, chunk_config, req.texts, *resp);
+            submitRows(scheduler, row_ids, resp, [resp, &output] { output.writeResponse(*resp); });
+        } catch (const std::exception& e) {
+            output.writeError(id, e.what());
+        }
+    }
+
+    scheduler.stop();
+    scheduler.printReport(std::cerr);
+    return 0;
+}
+
+// ============================================================================
+// Socket Server Mode (--listen)
+// ============================================================================
+
+// Length-prefixed binary protocol on a Unix stream socket. Any number of
+// clients can connect; all of them feed the same BatchScheduler, so requests
+// from different clients share batches. Integers are little-endian; every
+// message is a frame: u32 payload length, then the payload.
+//
+// Request payload:
+//   u32 request_id   echoed back; responses may arrive out of order
+//   u8  op           1 = embed, 2 = stats
+//   u8  flags        bit 0 = chunk (embed whole documents, see --chunk)
+//   u16 reserved     0
+//   embed: u32 count, then count x (u32 byte length, UTF-8 text)
+//
+// Response payload:
+//   u32 request_id
+//   u8  status       0 = ok, 1 = error
+//   u8  op           as requested
+//   u16 reserved
+//   embed: u32 count, u32 dim, count x dim f32 (L2-normalized rows)
+//   stats: the same JSON object as {"stats": true} in --serve
+//   error: UTF-8 message
+// A frame that cannot be parsed gets an error response with its request_id
+// (0 if even that is missing). An oversized frame ends the connection after
+// the error is sent, since the stream cannot be resynchronized.
+static_assert(__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__, "socket protocol assumes a little-endian host");
+
+constexpr uint8_t kSocketOpEmbed = 1;
+constexpr uint8_t kSocketOpStats = 2;
+constexpr uint8_t kSocketFlagChunk = 1;
+constexpr uint8_t kSocketStatusOk = 0;
+constexpr uint8_t kSocketStatusError = 1;
+constexpr size_t kSocketMaxFrame = size_t(64) << 20;
+// A client that stops reading stops being read once this much output is queued
+constexpr size_t kSocketMaxBufferedOutput = size_t(16) << 20;
+// Default cap on a client's unanswered embed requests (--listen-max-in-flight)
+constexpr size_t kSocketDefaultMaxInFlight = 64;
+
+static uint32_t loadU32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void appendU32(std::string& out, uint32_t v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+static void appendSocketHeader(std::string& out, size_t payload_bytes, uint32_t request_id, uint8_t status, uint8_t op) {
+    appendU32(out, static_cast<uint32_t>(payload_bytes));
+    appendU32(out, request_id);
+    out += static_cast<char>(status);
+    out += static_cast<char>(op);
+    out.append(2, '\0');
+}
+
+static std::string socketErrorFrame(uint32_t request_id, uint8_t op, const std::string& message) {
+    std::string frame;
+    appendSocketHeader(frame, 8 + message.size(), request_id, kSocketStatusError, op);
+    frame += message;
+    return frame;
+}
+
+static std::string socketEmbedFrame(uint32_t request_id, const PendingResponse& resp, ChunkPooling pooling) {
+    if (!resp.error.empty()) return socketErrorFrame(request_id, kSocketOpEmbed, resp.error);
+
+    const size_t count = resp.text_rows.size() - 1;
+    std::vector<ChunkedEmbedding> docs;
+    if (resp.chunk) {
+        for (size_t t = 0; t < count; ++t) docs.push_back(collectChunks(resp, t, pooling));
+    }
+    auto row = [&](size_t t) -> const std::vector<float>& {
+        return resp.chunk ? docs[t].document : resp.rows[t];
+    };
+    const size_t dim = count > 0 ? row(0).size() : 0;
+
+    std::string frame;
+    frame.reserve(4 + 16 + count * dim * sizeof(float));
+    appendSocketHeader(frame, 16 + count * dim * sizeof(float), request_id, kSocketStatusOk, kSocketOpEmbed);
+    appendU32(frame, static_cast<uint32_t>(count));
+    appendU32(frame, static_cast<uint32_t>(dim));
+    for (size_t t = 0; t < count; ++t) {
+        frame.append(reinterpret_cast<const char*>(row(t).data()), dim * sizeof(float));
+    }
+    return frame;
+}
+
+static void setNonBlocking(int fd) {
+    int flags = ::fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || ::fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0 || ::fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) {
+        throw std::runtime_error(std::string("fcntl: ") + std::strerror(errno));
+    }
+}
+
+// Readiness notification: epoll on Linux, poll(2) elsewhere (macOS).
+// Level-triggered in both cases.
+class EventPoller {
+public:
+    struct Event {
+        int fd;
+        bool readable;
+        bool writable;
+        bool hangup;   // peer closed; buffered input may still be readable
+        bool error;
+    };
+
+private:
+#ifdef __linux__
+    int epfd_ = -1;
+    std::vector<epoll_event> ready_ = std::vector<epoll_event>(128);
+
+    void control(int op, int fd, bool read, bool write) {
+        epoll_event ev{};
+        ev.events = (read ? EPOLLIN : 0u) | (write ? EPOLLOUT : 0u);
+        ev.data.fd = fd;
+        if (::epoll_ctl(epfd_, op, fd, &ev) < 0) {
+            throw std::runtime_error(std::string("epoll_ctl: ") + std::strerror(errno));
+        }
+    }
+#else
+    std::vector<pollfd> fds_;
+
+    static short mask(bool read, bool write) {
+        return static_cast<short>((read ? POLLIN : 0) | (write ? POLLOUT : 0));
+    }
+#endif
+
+public:
+    EventPoller() {
+#ifdef __linux__
+        epfd_ = ::epoll_create1(EPOLL_CLOEXEC);
+        if (epfd_ < 0) throw std::runtime_error(std::string("epoll_create1: ") + std::strerror(errno));
+#endif
+    }
+
+    ~EventPoller() {
+#ifdef __linux__
+        if (epfd_ >= 0) ::close(epfd_);
+#endif
+    }
+
+    EventPoller(const EventPoller&) = delete;
+    EventPoller& operator=(const EventPoller&) = delete;
+
+    void add(int fd, bool read, bool write) {
+#ifdef __linux__
+        control(EPOLL_CTL_ADD, fd, read, write);
+#else
+        fds_.push_back({fd, mask(read, write), 0});
+#endif
+    }
+
+    void update(int fd, bool read, bool write) {
+#ifdef __linux__
+        control(EPOLL_CTL_MOD, fd, read, write);
+#else
+        for (auto& p : fds_) {
+            if (p.fd == fd) p.events = mask(read, write);
+        }
+#endif
+    }
+
+    void remove(int fd) {
+#ifdef __linux__
+        ::epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+#else
+        fds_.erase(std::remove_if(fds_.begin(), fds_.end(), [fd](const pollfd& p) { return p.fd == fd; }),
+                   fds_.end());
+#endif
+    }
+
+    // Blocks until something is ready; an interrupted wait returns no events
+    void wait(std::vector<Event>& events) {
+        events.clear();
+#ifdef __linux__
+        int n = ::epoll_wait(epfd_, ready_.data(), static_cast<int>(ready_.size()), -1);
+        for (int i = 0; i < n; ++i) {
+            uint32_t e = ready_[i].events;
+            events.push_back({ready_[i].data.fd, (e & EPOLLIN) != 0, (e & EPOLLOUT) != 0,
+                              (e & EPOLLHUP) != 0, (e & EPOLLERR) != 0});
+        }
+#else
+        if (::poll(fds_.data(), fds_.size(), -1) <= 0) return;
+        for (const auto& p : fds_) {
+            if (p.revents == 0) continue;
+            events.push_back({p.fd, (p.revents & POLLIN) != 0, (p.revents & POLLOUT) != 0,
+                              (p.revents & POLLHUP) != 0, (p.revents & (POLLERR | POLLNVAL)) != 0});
+        }
+#endif
+    }
+};
+
+// One client. `in`, `eof` and the interest flags belong to the event loop;
+// `out` is appended to by scheduler workers and drained by the loop.
+struct SocketConnection {
+    int fd = -1;
+    std::string in;
+    bool eof = false;          // client closed its write side (or broke the protocol)
+    bool reading = true;       // registered interest; neither = not in the poller
+    bool writing = false;
+
+    std::mutex mutex;
+    std::string out;
+    size_t out_pos = 0;
+    size_t in_flight = 0;      // embed requests not answered yet
+    bool open = true;
+};
+
+// Written by the SIGINT/SIGTERM handler to wake the event loop
+static int g_socket_wake_fd = -1;
+
+static void onSocketStopSignal(int) {
+    int saved = errno;
+    char c = 's';
+    if (g_socket_wake_fd >= 0) (void)!::write(g_socket_wake_fd, &c, 1);
+    errno = saved;
+}
+
+class SocketServer {
+private:
+    WordPieceTokenizer& tokenizer_;
+    BatchScheduler& scheduler_;
+    const ChunkConfig& chunk_config_;
+    std::string path_;
+    size_t max_in_flight_;
+    int listen_fd_ = -1;
+    int wake_[2] = {-1, -1};   // completions and signals -> event loop
+    bool stopping_ = false;
+    EventPoller poller_;
+    std::unordered_map<int, std::shared_ptr<SocketConnection>> conns_;
+    std::vector<char> read_buf_ = std::vector<char>(64 * 1024);
+
+    std::mutex dirty_mutex_;
+    std::vector<std::shared_ptr<SocketConnection>> dirty_;   // have new output
+
+    void wake() {
+        char c = 'w';
+        (void)!::write(wake_[1], &c, 1);   // a full pipe already means "wake up"
+    }
+
+    // Queues a response frame; callable from any thread
+    void post(const std::shared_ptr<SocketConnection>& conn, const std::string& frame, bool finishes_request) {
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            if (finishes_request) conn->in_flight -= 1;
+            if (conn->open) conn->out += frame;
+        }
+        {
+            std::lock_guard<std::mutex> lock(dirty_mutex_);
+            dirty_.push_back(conn);
+        }
+        wake();
+    }
+
+    static int listenOn(const std::string& path) {
+        sockaddr_un addr{};
+        if (path.size() >= sizeof(addr.sun_path)) throw std::runtime_error("socket path too long: " + path);
+        addr.sun_family = AF_UNIX;
+        std::memcpy(addr.sun_path, path.c_str(), path.size() + 1);
+
+        struct stat st;
+        if (::lstat(path.c_str(), &st) == 0) {
+            if (!S_ISSOCK(st.st_mode)) throw std::runtime_error(path + " exists and is not a socket");
+            // A stale socket file from a dead server is replaced; a live one is not
+            int probe = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            bool live = probe >= 0 && ::connect(probe, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) == 0;
+            if (probe >= 0) ::close(probe);
+            if (live) throw std::runtime_error("another server is listening on " + path);
+            ::unlink(path.c_str());
+        }
+
+        int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fd < 0) throw std::runtime_error(std::string("socket: ") + std::strerror(errno));
+        if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 || ::listen(fd, SOMAXCONN) < 0) {
+            int err = errno;
+            ::close(fd);
+            throw std::runtime_error("cannot listen on " + path + ": " + std::strerror(err));
+        }
+        setNonBlocking(fd);
+        return fd;
+    }
+
+    void acceptClients() {
+        while (true) {
+            int fd = ::accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0) {
+                if (errno == EINTR) continue;
+                if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                    std::cerr << "Warning: accept on " << path_ << ": " << std::strerror(errno) << std::endl;
+                }
+                return;
+            }
+            setNonBlocking(fd);
+            auto conn = std::make_shared<SocketConnection>();
+            conn->fd = fd;
+            poller_.add(fd, true, false);
+            conns_[fd] = std::move(conn);
+        }
+    }
+
+    void closeConnection(const std::shared_ptr<SocketConnection>& conn) {
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            conn->open = false;
+            conn->out.clear();
+            conn->out_pos = 0;
+        }
+        poller_.remove(conn->fd);
+        ::close(conn->fd);
+        conns_.erase(conn->fd);
+    }
+
+    // Writes as much queued output as the socket accepts; false on a broken
+    // connection
+    bool flush(SocketConnection& conn) {
+        std::lock_guard<std::mutex> lock(conn.mutex);
+        while (conn.out_pos < conn.out.size()) {
+            ssize_t n = ::write(conn.fd, conn.out.data() + conn.out_pos, conn.out.size() - conn.out_pos);
+            if (n > 0) {
+                conn.out_pos += static_cast<size_t>(n);
+            } else if (n < 0 && errno == EINTR) {
+                continue;
+            } else if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                break;
+            } else {
+                return false;
+            }
+        }
+        if (conn.out_pos == conn.out.size()) {
+            conn.out.clear();
+            conn.out_pos = 0;
+        } else if (conn.out_pos > conn.out.size() / 2) {
+            conn.out.erase(0, conn.out_pos);
+            conn.out_pos = 0;
+        }
+        return true;
+    }
+
+    // Re-derives the poller interest from the connection state; closes a
+    // connection whose client is done once everything has been answered.
+    // Frames held back by the in-flight cap are picked up here as answers
+    // come in.
+    void refresh(const std::shared_ptr<SocketConnection>& conn) {
+        processFrames(conn);
+        size_t pending, in_flight;
+        {
+            std::lock_guard<std::mutex> lock(conn->mutex);
+            pending = conn->out.size() - conn->out_pos;
+            in_flight = conn->in_flight;
+        }
+        if (conn->eof && pending == 0 && in_flight == 0) {
+            closeConnection(conn);
+            return;
+        }
+        bool reading = !conn->eof && pending < kSocketMaxBufferedOutput && in_flight < max_in_flight_;
+        bool writing = pending > 0;
+        if (reading == conn->reading && writing == conn->writing) return;
+        // With no interest the fd leaves the poller altogether: a hangup is
+        // reported regardless of interest and would spin the loop
+        if (!reading && !writing) {
+            poller_.remove(conn->fd);
+        } else if (!conn->reading && !conn->writing) {
+            poller_.add(conn->fd, reading, writing);
+        } else {
+            poller_.update(conn->fd, reading, writing);
+        }
+        conn->reading = reading;
+        conn->writing = writing;
+    }
+
+    bool atInFlightCap(SocketConnection& conn) {
+        std::lock_guard<std::mutex> lock(conn.mutex);
+        return conn.in_flight >= max_in_flight_;
+    }
+
+    void handleFrame(const std::shared_ptr<SocketConnection>& conn, const char* p, size_t n) {
+        uint32_t request_id = n >= 4 ? loadU32(p) : 0;
+        uint8_t op = n >= 5 ? static_cast<uint8_t>(p[4]) : 0;
+        try {
+            if (n < 8) throw std::runtime_error("frame shorter than the request header");
+            uint8_t flags = static_cast<uint8_t>(p[5]);
+
+            if (op == kSocketOpStats) {
+                std::string json = scheduler_.statsJson();
+                std::string frame;
+                appendSocketHeader(frame, 8 + json.size(), request_id, kSocketStatusOk, op);
+                frame += json;
+                post(conn, frame, false);
+                return;
+            }
+            if (op != kSocketOpEmbed) throw std::runtime_error("unknown op " + std::to_string(op));
+
+            if (n < 12) throw std::runtime_error("embed request without a text count");
+            uint32_t count = loadU32(p + 8);
+            std::vector<std::string> texts;
+            size_t pos = 12;
+            for (uint32_t t = 0; t < count; ++t) {
+                if (n - pos < 4) throw std::runtime_error("truncated text length");
+                uint32_t len = loadU32(p + pos);
+                pos += 4;
+                if (n - pos < len) throw std::runtime_error("truncated text");
+                texts.emplace_back(p + pos, len);
+                pos += len;
+            }
+            if (pos != n) throw std::runtime_error("trailing bytes after the last text");
+
+            auto resp = std::make_shared<PendingResponse>();
+            resp->batch = true;
+            resp->chunk = (flags & kSocketFlagChunk) != 0;
+            auto row_ids = tokenizeRequest(tokenizer_, scheduler_, chunk_config_, texts, *resp);
+            {
+                std::lock_guard<std::mutex> lock(conn->mutex);
+                conn->in_flight += 1;
+            }
+            const ChunkPooling pooling = chunk_config_.pooling;
+            submitRows(scheduler_, row_ids, resp, [this, conn, resp, request_id, pooling] {
+                post(conn, socketEmbedFrame(request_id, *resp, pooling), true);
+            });
+        } catch (const std::exception& e) {
+            post(conn, socketErrorFrame(request_id, op, e.what()), false);
+        }
+    }
+
+    // Reads until the socket is drained, the client hits its in-flight cap,
+    // or end of stream; what stays in the kernel buffer is read once answers
+    // bring the client back under the cap
+    void onReadable(const std::shared_ptr<SocketConnection>& conn) {
+        while (true) {
+            processFrames(conn);
+            if (conn->eof || atInFlightCap(*conn)) return;
+            ssize_t n = ::read(conn->fd, read_buf_.data(), read_buf_.size());
+            if (n > 0) {
+                conn->in.append(read_buf_.data(), static_cast<size_t>(n));
+            } else if (n == 0) {
+                conn->eof = true;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return;
+            } else {
+                closeConnection(conn);
+                return;
+            }
+        }
+    }
+
+    // Handles the complete frames in `in` while the client is under its
+    // in-flight cap
+    void processFrames(const std::shared_ptr<SocketConnection>& conn) {
+        size_t pos = 0;
+        while (conn->in.size() - pos >= 4 && !atInFlightCap(*conn)) {
+            size_t len = loadU32(conn->in.data() + pos);
+            if (len > kSocketMaxFrame) {
+                post(conn, socketErrorFrame(0, 0, "frame of " + std::to_string(len) + " bytes exceeds the " +
+                                                  std::to_string(kSocketMaxFrame) + "-byte limit"), false);
+                conn->eof = true;
+                pos = conn->in.size();
+                break;
+            }
+            if (conn->in.size() - pos - 4 < len) break;
+            handleFrame(conn, conn->in.data() + pos + 4, len);
+            pos += 4 + len;
+        }
+        conn->in.erase(0, pos);
+    }
+
+    void flushDirty() {
+        std::vector<std::shared_ptr<SocketConnection>> dirty;
+        {
+            std::lock_guard<std::mutex> lock(dirty_mutex_);
+            dirty.swap(dirty_);
+        }
+        for (const auto& conn : dirty) {
+            auto it = conns_.find(conn->fd);
+            if (it == conns_.end() || it->second != conn) continue;   // already closed
+            if (!flush(*conn)) {
+                closeConnection(conn);
+                continue;
+            }
+            refresh(conn);
+        }
+    }
+
+    // Returns true when a stop signal was among the wake-ups
+    bool drainWake() {
+        bool stop = false;
+        char buf[256];
+        ssize_t n;
+        while ((n = ::read(wake_[0], buf, sizeof(buf))) > 0) {
+            if (std::memchr(buf, 's', static_cast<size_t>(n))) stop = true;
+        }
+        return stop;
+    }
+
+    // Answers everything already queued, then closes every connection. Each
+    // client gets at most a second to take its remaining output.
+    void shutdownClients() {
+        scheduler_.stop();
+        flushDirty();
+        for (auto& entry : conns_) {
+            int fd = entry.first;
+            int flags = ::fcntl(fd, F_GETFL, 0);
+            if (flags >= 0) ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK);
+            timeval timeout{1, 0};
+            ::setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+            flush(*entry.second);
+        }
+        while (!conns_.empty()) {
+            // A copy: closeConnection erases the map entry it would point into
+            auto conn = conns_.begin()->second;
+            closeConnection(conn);
+        }
+    }
+
 public:
-    bool load(const std::string& vocab_path) {
-        std::ifstream file(vocab_path);
-        if (!file.is_open()) return false;
+    SocketServer(WordPieceTokenizer& tokenizer, BatchScheduler& scheduler, const ChunkConfig& chunk_config,
+                 std::string path, size_t max_in_flight)
+        : tokenizer_(tokenizer), scheduler_(scheduler), chunk_config_(chunk_config), path_(std::move(path)),
+          max_in_flight_(std::max<size_t>(1, max_in_flight)) {
+        listen_fd_ = listenOn(path_);
+        if (::pipe(wake_) < 0) {
+            int err = errno;
+            ::close(listen_fd_);
+            ::unlink(path_.c_str());
+            throw std::runtime_error(std::string("pipe: ") + std::strerror(err));
+        }
+        setNonBlocking(wake_[0]);
+        setNonBlocking(wake_[1]);
+    }
 
-        std::string line;
-        int64_t idx = 0;
-        while (std::getline(file, line)) {
-            // Strip trailing \r for Windows-style line endings
-            if (!line.empty() && line.back() == '\r') {
-                line.pop_back();
-            }
-            vocab_[line] = idx++;
+    ~SocketServer() {
+        g_socket_wake_fd = -1;
+        if (listen_fd_ >= 0) {
+            ::close(listen_fd_);
+            ::unlink(path_.c_str());
+        }
+        for (int fd : wake_) {
+            if (fd >= 0) ::close(fd);
         }
-        return !vocab_.empty();
     }
 
-    // Basic text normalization: lowercase + strip accents + split on whitespace/punct
-    std::vector<std::string> basicTokenize(const std::string& text) {
-        std::vector<std::string> tokens;
-        std::string current;
+    SocketServer(const SocketServer&) = delete;
+    SocketServer& operator=(const SocketServer&) = delete;
+
+    // Serves until SIGINT/SIGTERM
+    void run() {
+        std::signal(SIGPIPE, SIG_IGN);
+        g_socket_wake_fd = wake_[1];
+        struct sigaction action{};
+        action.sa_handler = onSocketStopSignal;
+        sigemptyset(&action.sa_mask);
+        ::sigaction(SIGINT, &action, nullptr);
+        ::sigaction(SIGTERM, &action, nullptr);
 
-        for (size_t i = 0; i < text.size(); ++i) {
-            unsigned char c = text[i];
-            if (c <= 0x20 || c == 0x7F) {
-                // Whitespace/control: flush current token
-                if (!current.empty()) {
-                    tokens.push_back(current);
-                    current.clear();
+        poller_.add(listen_fd_, true, false);
+        poller_.add(wake_[0], true, false);
+        std::cerr << "Ready (listening on " << path_ << ")" << std::endl;
+
+        std::vector<EventPoller::Event> events;
+        while (!stopping_) {
+            poller_.wait(events);
+            for (const auto& ev : events) {
+                if (ev.fd == wake_[0]) {
+                    if (drainWake()) stopping_ = true;
+                    continue;
                 }
-            } else if ((c >= '!' && c <= '/') || (c >= ':' && c <= '@') ||
-                       (c >= '[' && c <= '`') || (c >= '{' && c <= '~')) {
-                // Punctuation: flush + add as separate token
-                if (!current.empty()) {
-                    tokens.push_back(current);
-                    current.clear();
+                if (ev.fd == listen_fd_) {
+                    acceptClients();
+                    continue;
                 }
-                current += static_cast<char>(c);
-                tokens.push_back(current);
-                current.clear();
-            } else {
-                // Lowercase ASCII
-                if (c >= 'A' && c <= 'Z') {
-                    current += static_cast<char>(c + 32);
-                } else {
-                    current += static_cast<char>(c);
+                auto it = conns_.find(ev.fd);
+                if (it == conns_.end()) continue;
+                auto conn = it->second;
+                if (ev.error) {
+                    closeConnection(conn);
+                    continue;
+                }
+                // A hangup still leaves the client's last frames to read; the
+                // connection closes through the eof path once they are answered
+                if (ev.readable || ev.hangup) {
+                    onReadable(conn);
+                    if (!conns_.count(ev.fd)) continue;
                 }
+                if (ev.writable && !flush(*conn)) {
+                    closeConnection(conn);
+                    continue;
+                }
+                refresh(conn);
             }
+            flushDirty();
         }
-        if (!current.empty()) {
-            tokens.push_back(current);
+
+        std::cerr << "Stopping (" << conns_.size() << " clients connected)" << std::endl;
+        shutdownClients();
+    }
+};
+
+static int runSocketServer(WordPieceTokenizer& tokenizer, BatchScheduler& scheduler, const ChunkConfig& chunk_config,
+                           const std::string& path, size_t max_in_flight) {
+    SocketServer server(tokenizer, scheduler, chunk_config, path, max_in_flight);
+    server.run();
+    scheduler.printReport(std::cerr);
+    return 0;
+}
+
+// ============================================================================
+// Bulk Embedding (--input / --output)
+// ============================================================================
+
+// Blocking FIFO with a capacity: push() waits while the queue is full, which
+// is what bounds memory between pipeline stages. close() ends the stream (pop
+// drains what is left, then returns false); cancel() also drops queued items
+// and releases blocked producers.
+template <typename T>
+class BoundedQueue {
+private:
+    std::deque<T> items_;
+    const size_t capacity_;
+    bool closed_ = false;
+    std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(std::max<size_t>(1, capacity)) {}
+
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_full_.wait(lock, [&] { return closed_ || items_.size() < capacity_; });
+        if (closed_) return false;
+        items_.push_back(std::move(item));
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    bool pop(T& item) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [&] { return closed_ || !items_.empty(); });
+        if (items_.empty()) return false;
+        item = std::move(items_.front());
+        items_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
         }
-        return tokens;
+        not_empty_.notify_all();
+        not_full_.notify_all();
     }
 
-    // WordPiece subword tokenization
-    std::vector<int64_t> wordPieceTokenize(const std::string& word) {
-        if (word.size() > static_cast<size_t>(max_input_chars_)) {
-            return {unk_id_};
+    void cancel() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+            items_.clear();
         }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+};
 
-        std::vector<int64_t> output_ids;
-        size_t start = 0;
+struct BulkConfig {
+    std::string input_path;
+    std::string output_path;
+    VectorDtype dtype = VectorDtype::F32;
+    int tokenizer_threads = 2;
+    int64_t max_batch_tokens = 8192;   // padded tokens (rows x longest row) per forward pass
+    size_t sort_window = 4096;         // rows sorted by length before batching (0 = input order)
+    bool dedup = true;                 // run each distinct token sequence once
+    std::string dedup_from;            // earlier --output whose rows may be reused
+};
 
-        while (start < word.size()) {
-            size_t end = word.size();
-            int64_t found_id = -1;
+// Identity of a token-id sequence under one model: two independently seeded
+// 64-bit hashes, so a collision (which would silently give a row another
+// text's vector) is out of reach at any realistic row count. Bulk runs store
+// one key per row in "<output>.keys" (a header with magic "AEMK" and the row
+// count, then count x 16 bytes), which later runs can dedup against.
+struct RowKey {
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    bool operator==(const RowKey& other) const { return lo == other.lo && hi == other.hi; }
+};
+
+struct RowKeyHash {
+    size_t operator()(const RowKey& key) const { return static_cast<size_t>(key.lo); }
+};
+
+static RowKey rowKey(const std::vector<int64_t>& ids, uint64_t model_id) {
+    return {hashTokens(ids.data(), ids.size(), model_id),
+            hashTokens(ids.data(), ids.size(), model_id ^ 0xA0761D6478BD642FULL)};
+}
 
-            while (start < end) {
-                std::string substr;
-                if (start > 0) {
-                    substr = "##" + word.substr(start, end - start);
+// Input: one JSON value per line, either a string or an object with a "text"
+// field (other fields are ignored). Blank lines are skipped; every other line
+// is one output row, in file order.
+static void bulkLineText(std::string_view line, std::string& text) {
+    std::string source(line);
+    JsonReader reader(source);
+    if (reader.peek() == '"') {
+        reader.parseString(text);
+    } else {
+        bool have_text = false;
+        reader.expect('{');
+        if (!reader.consume('}')) {
+            std::string key;
+            do {
+                reader.parseString(key);
+                reader.expect(':');
+                if (key == "text") {
+                    reader.parseString(text);
+                    have_text = true;
                 } else {
-                    substr = word.substr(start, end - start);
+                    reader.skipValue();
                 }
+            } while (reader.consume(','));
+            reader.expect('}');
+        }
+        if (!have_text) throw std::runtime_error("object has no \"text\" field");
+    }
+    if (!reader.atEnd()) throw std::runtime_error("invalid JSON: trailing data");
+}
 
-                auto it = vocab_.find(substr);
-                if (it != vocab_.end()) {
-                    found_id = it->second;
-                    break;
+// Three stages joined by bounded queues:
+//   read + tokenize   the input is mmap'ed and split into line blocks on the
+//                     calling thread; a pool of tokenizer threads parses them
+//   batch + infer     a batcher sorts each window of rows by token count and
+//                     packs near-uniform-length batches under the padded-
+//                     token budget; one worker per replica runs them
+//   write             rows are pwrite()n at their index, so completion order
+//                     does not matter; the header goes in last
+// Rows whose token ids repeat an earlier row (or a row of --dedup-from) skip
+// the model: the batcher turns them into copies that the writer fans out.
+class BulkEmbedder {
+private:
+    struct LineBlock {
+        size_t first_row = 0;
+        size_t first_line = 0;   // 1-based line number of the first entry, for errors
+        std::vector<std::pair<size_t, std::string_view>> lines;   // (line number, text)
+    };
+    struct Row {
+        size_t index = 0;
+        RowKey key;
+        std::vector<int64_t> ids;
+    };
+    struct Batch {
+        std::vector<size_t> index;
+        std::vector<RowKey> keys;
+        std::vector<std::vector<int64_t>> ids;
+        int64_t tokens = 0;
+    };
+    // Row `index` gets the vector of row `source`: an earlier row of this run,
+    // or (previous = true) a row of the --dedup-from file
+    struct Copy {
+        size_t index = 0;
+        size_t source = 0;
+        bool previous = false;
+        RowKey key;
+    };
+    struct Result {
+        std::vector<size_t> index;
+        std::vector<RowKey> keys;
+        std::vector<float> rows;
+        int64_t tokens = 0;
+        std::vector<Copy> copies;
+    };
+
+    static constexpr size_t kLinesPerBlock = 256;
+
+    const WordPieceTokenizer& tokenizer_;
+    ReplicaPool& pool_;
+    BulkConfig config_;
+    const uint64_t model_id_;
+    size_t row_bytes_ = 0;
+
+    // --dedup-from: the earlier output, mapped, and its keys by row
+    MappedFile previous_rows_;
+    std::unordered_map<RowKey, size_t, RowKeyHash> previous_;
+
+    BoundedQueue<LineBlock> lines_{64};
+    BoundedQueue<std::vector<Row>> rows_{16};
+    BoundedQueue<Batch> batches_;
+    BoundedQueue<Result> results_{16};
+
+    std::mutex error_mutex_;
+    std::exception_ptr error_;
+
+    std::atomic<size_t> total_rows_{0};
+    std::atomic<bool> input_done_{false};
+    // Batcher-side totals (padding), written by the batcher thread only.
+    // input_order_padded_ is what packing the same windows unsorted costs.
+    uint64_t real_tokens_ = 0;
+    uint64_t padded_tokens_ = 0;
+    uint64_t input_order_padded_ = 0;
+    uint64_t batch_count_ = 0;
+    // Dedup (batcher thread): first row of each key, and what was skipped
+    std::unordered_map<RowKey, size_t, RowKeyHash> seen_;
+    size_t repeat_rows_ = 0;
+    size_t reused_rows_ = 0;
+    uint64_t skipped_tokens_ = 0;
+    // Writer-side state: rows already on disk, and copies waiting for their
+    // source row
+    size_t rows_written_ = 0;
+    uint64_t tokens_written_ = 0;
+    std::vector<uint8_t> written_;
+    std::unordered_map<size_t, std::vector<Copy>> waiting_;
+
+    void fail(std::exception_ptr error) {
+        {
+            std::lock_guard<std::mutex> lock(error_mutex_);
+            if (!error_) error_ = error;
+        }
+        lines_.cancel();
+        rows_.cancel();
+        batches_.cancel();
+        results_.cancel();
+    }
+
+    template <typename Body>
+    std::thread stage(Body body) {
+        return std::thread([this, body] {
+            try {
+                body();
+            } catch (...) {
+                fail(std::current_exception());
+            }
+        });
+    }
+
+    void readLines(const MappedFile& input) {
+        const char* data = reinterpret_cast<const char*>(input.data());
+        const size_t size = input.size();
+        LineBlock block;
+        size_t row = 0, line_no = 0, pos = 0;
+        while (pos < size) {
+            const char* nl = static_cast<const char*>(std::memchr(data + pos, '\n', size - pos));
+            size_t end = nl ? static_cast<size_t>(nl - data) : size;
+            std::string_view line(data + pos, end - pos);
+            pos = end + 1;
+            ++line_no;
+            if (line.find_first_not_of(" \t\r") == std::string_view::npos) continue;
+
+            if (block.lines.empty()) {
+                block.first_row = row;
+                block.first_line = line_no;
+            }
+            block.lines.emplace_back(line_no, line);
+            ++row;
+            if (block.lines.size() == kLinesPerBlock) {
+                if (!lines_.push(std::move(block))) return;
+                block = LineBlock();
+            }
+        }
+        if (!block.lines.empty()) lines_.push(std::move(block));
+        total_rows_ = row;
+        input_done_ = true;
+    }
+
+    void tokenizeLines() {
+        LineBlock block;
+        std::string text;
+        std::vector<int64_t> scratch;   // tokenizeInto reserves for the worst case
+        while (lines_.pop(block)) {
+            std::vector<Row> rows(block.lines.size());
+            for (size_t i = 0; i < block.lines.size(); ++i) {
+                try {
+                    bulkLineText(block.lines[i].second, text);
+                } catch (const std::exception& e) {
+                    throw std::runtime_error(config_.input_path + ":" + std::to_string(block.lines[i].first) +
+                                             ": " + e.what());
                 }
-                --end;
+                rows[i].index = block.first_row + i;
+                tokenizer_.tokenizeInto(text, scratch);
+                rows[i].ids.assign(scratch.begin(), scratch.end());
+                rows[i].key = rowKey(rows[i].ids, model_id_);
             }
+            if (!rows_.push(std::move(rows))) return;
+        }
+    }
 
-            if (found_id == -1) {
-                output_ids.push_back(unk_id_);
-                break;
+    // Splits rows[begin, end) into batches, in order: a batch ends before the
+    // row that would push rows x longest past the padded-token budget.
+    // Returns each batch's end and adds its padded tokens to `padded`.
+    std::vector<size_t> batchBounds(const std::vector<Row>& rows, uint64_t& padded) const {
+        std::vector<size_t> bounds;
+        int64_t longest = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i < rows.size(); ++i) {
+            int64_t next_longest = std::max(longest, static_cast<int64_t>(rows[i].ids.size()));
+            if (i > begin && next_longest * static_cast<int64_t>(i - begin + 1) > config_.max_batch_tokens) {
+                padded += static_cast<uint64_t>(longest) * (i - begin);
+                bounds.push_back(i);
+                begin = i;
+                next_longest = static_cast<int64_t>(rows[i].ids.size());
             }
+            longest = next_longest;
+        }
+        if (begin < rows.size()) {
+            padded += static_cast<uint64_t>(longest) * (rows.size() - begin);
+            bounds.push_back(rows.size());
+        }
+        return bounds;
+    }
 
-            output_ids.push_back(found_id);
-            start = end;
+    // Batches one window. Input order is the baseline for the padding report;
+    // the window is then sorted by token count (ties by index), so each batch
+    // holds rows of nearly equal length and pads little. The writer puts rows
+    // back at their index, which restores input order in the output.
+    bool packWindow(std::vector<Row>& window) {
+        std::sort(window.begin(), window.end(), [](const Row& a, const Row& b) { return a.index < b.index; });
+        batchBounds(window, input_order_padded_);
+        if (config_.sort_window > 0) {
+            std::sort(window.begin(), window.end(), [](const Row& a, const Row& b) {
+                return a.ids.size() != b.ids.size() ? a.ids.size() < b.ids.size() : a.index < b.index;
+            });
         }
 
-        return output_ids;
+        size_t begin = 0;
+        for (size_t end : batchBounds(window, padded_tokens_)) {
+            Batch batch;
+            for (size_t i = begin; i < end; ++i) {
+                batch.tokens += static_cast<int64_t>(window[i].ids.size());
+                batch.index.push_back(window[i].index);
+                batch.keys.push_back(window[i].key);
+                batch.ids.push_back(std::move(window[i].ids));
+            }
+            real_tokens_ += static_cast<uint64_t>(batch.tokens);
+            batch_count_ += 1;
+            if (!batches_.push(std::move(batch))) return false;
+            begin = end;
+        }
+        window.clear();
+        return true;
     }
 
-    std::pair<std::vector<int64_t>, std::vector<int64_t>> tokenize(const std::string& text) {
-        auto words = basicTokenize(text);
+    // Turns a repeated row into a copy; false if it has to run
+    bool dedupRow(const Row& row, std::vector<Copy>& copies) {
+        if (config_.dedup) {
+            auto [it, first] = seen_.emplace(row.key, row.index);
+            if (!first) {
+                copies.push_back({row.index, it->second, false, row.key});
+                repeat_rows_ += 1;
+                skipped_tokens_ += row.ids.size();
+                return true;
+            }
+        }
+        auto it = previous_.find(row.key);
+        if (it == previous_.end()) return false;
+        copies.push_back({row.index, it->second, true, row.key});
+        reused_rows_ += 1;
+        skipped_tokens_ += row.ids.size();
+        return true;
+    }
 
-        std::vector<int64_t> input_ids;
-        input_ids.push_back(cls_id_);
+    // Gathers --sort-window rows at a time (without sorting: one tokenizer
+    // block at a time, in arrival order). Copies follow the batches of the
+    // window they were found in, through the same queue.
+    void batchRows() {
+        const size_t window_rows = std::max<size_t>(1, config_.sort_window);
+        std::vector<Row> window, rows;
+        std::vector<Copy> copies;
+        auto flushCopies = [&] {
+            if (copies.empty()) return true;
+            Result result;
+            result.copies = std::move(copies);
+            copies.clear();
+            return results_.push(std::move(result));
+        };
 
-        for (const auto& word : words) {
-            auto subword_ids = wordPieceTokenize(word);
-            for (auto id : subword_ids) {
-                if (static_cast<int>(input_ids.size()) >= max_seq_len_ - 1) break;
-                input_ids.push_back(id);
+        while (rows_.pop(rows)) {
+            for (auto& row : rows) {
+                if (!dedupRow(row, copies)) window.push_back(std::move(row));
             }
-            if (static_cast<int>(input_ids.size()) >= max_seq_len_ - 1) break;
+            if (window.size() >= window_rows) {
+                if (!packWindow(window)) return;
+            }
+            if ((window.empty() || copies.size() >= window_rows) && !flushCopies()) return;
+        }
+        if (!window.empty() && !packWindow(window)) return;
+        flushCopies();
+    }
+
+    void infer(size_t replica) {
+        applyPlacement(pool_.placement(replica));
+        Batch batch;
+        while (batches_.pop(batch)) {
+            Result result;
+            result.rows = pool_.replica(replica).embedBatch(batch.ids);
+            result.index = std::move(batch.index);
+            result.keys = std::move(batch.keys);
+            result.tokens = batch.tokens;
+            if (!results_.push(std::move(result))) return;
         }
+    }
 
-        input_ids.push_back(sep_id_);
+    off_t rowOffset(size_t index) const {
+        return static_cast<off_t>(sizeof(EmbeddingFileHeader) + index * row_bytes_);
+    }
 
-        std::vector<int64_t> attention_mask(input_ids.size(), 1);
-        return {input_ids, attention_mask};
+    // Row `index` is on disk: record its key, then serve copies waiting on it
+    void markWritten(int fd, int keys_fd, size_t index, const RowKey& key) {
+        pwriteFully(keys_fd, reinterpret_cast<const char*>(&key), sizeof(key),
+                    static_cast<off_t>(sizeof(EmbeddingFileHeader) + index * sizeof(RowKey)));
+        if (written_.size() <= index) written_.resize(std::max(index + 1, written_.size() * 2));
+        written_[index] = 1;
+        rows_written_ += 1;
+
+        auto it = waiting_.find(index);
+        if (it == waiting_.end()) return;
+        auto copies = std::move(it->second);
+        waiting_.erase(it);
+        for (const auto& copy : copies) applyCopy(fd, keys_fd, copy);
     }
-};
 
-// ============================================================================
-// Arctic Embed Model
-// ============================================================================
+    void applyCopy(int fd, int keys_fd, const Copy& copy) {
+        thread_local std::string row;
+        row.resize(row_bytes_);
+        if (copy.previous) {
+            std::memcpy(&row[0], previous_rows_.data() + rowOffset(copy.source), row_bytes_);
+        } else if (copy.source < written_.size() && written_[copy.source]) {
+            preadFully(fd, &row[0], row_bytes_, rowOffset(copy.source));
+        } else {
+            waiting_[copy.source].push_back(copy);
+            return;
+        }
+        pwriteFully(fd, row.data(), row_bytes_, rowOffset(copy.index));
+        markWritten(fd, keys_fd, copy.index, copy.key);
+    }
 
-class ArcticEmbedLibTorch {
-private:
-    torch::jit::script::Module model_;
-    torch::Device device_;
+    // Writes each result's rows at their index, coalescing consecutive
+    // indices into one pwrite, then fans rows out to their copies; reports
+    // progress about once a second
+    void writeRows(int fd, int keys_fd, size_t dim) {
+        const auto start = std::chrono::steady_clock::now();
+        auto last_report = start;
+        std::vector<size_t> order;
+        std::string buffer;
 
-public:
-    ArcticEmbedLibTorch(const std::string& model_path, bool quiet = false)
-        : device_(torch::kMPS) {
+        Result result;
+        while (results_.pop(result)) {
+            const size_t n = result.index.size();
+            if (result.rows.size() != n * dim) {
+                throw std::runtime_error("engine returned " + std::to_string(result.rows.size() / std::max<size_t>(1, n)) +
+                                         "-dim rows, expected " + std::to_string(dim));
+            }
+            order.resize(n);
+            for (size_t i = 0; i < n; ++i) order[i] = i;
+            std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return result.index[a] < result.index[b]; });
 
-        if (!quiet) {
-            std::cerr << "Loading model on MPS..." << std::endl;
+            for (size_t i = 0; i < n;) {
+                size_t j = i + 1;
+                while (j < n && result.index[order[j]] == result.index[order[j - 1]] + 1) ++j;
+                buffer.clear();
+                for (size_t k = i; k < j; ++k) {
+                    appendVectorData(buffer, result.rows.data() + order[k] * dim, dim, config_.dtype);
+                }
+                pwriteFully(fd, buffer.data(), buffer.size(), rowOffset(result.index[order[i]]));
+                i = j;
+            }
+            for (size_t i = 0; i < n; ++i) markWritten(fd, keys_fd, result.index[i], result.keys[i]);
+            for (const auto& copy : result.copies) applyCopy(fd, keys_fd, copy);
+            tokens_written_ += static_cast<uint64_t>(result.tokens);
+
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_report >= std::chrono::seconds(1)) {
+                last_report = now;
+                reportProgress(std::chrono::duration<double>(now - start).count());
+            }
+        }
+        if (!waiting_.empty()) {
+            throw std::runtime_error(std::to_string(waiting_.size()) + " rows never written (dedup source missing)");
         }
+    }
 
-        try {
-            model_ = torch::jit::load(model_path);
-            model_.to(device_);
-            model_.eval();
-        } catch (const c10::Error& e) {
-            std::cerr << "Error loading model: " << e.what() << std::endl;
-            throw;
+    void preadFully(int fd, char* data, size_t n, off_t offset) {
+        while (n > 0) {
+            ssize_t got = ::pread(fd, data, n, offset);
+            if (got <= 0) {
+                if (got < 0 && errno == EINTR) continue;
+                throw std::runtime_error("read back from " + config_.output_path + " failed");
+            }
+            data += got;
+            offset += got;
+            n -= static_cast<size_t>(got);
         }
     }
 
-    std::vector<float> embed(const std::vector<int64_t>& input_ids,
-                             const std::vector<int64_t>& attention_mask) {
-        torch::NoGradGuard no_grad;
+    // Maps --dedup-from and indexes its keys. The file must match this run's
+    // dim and dtype, and its keys were seeded with the model identity, so
+    // vectors from another model (or device/precision) never match.
+    void loadPrevious(size_t dim) {
+        const std::string& path = config_.dedup_from;
+        MappedFile keys;
+        if (!previous_rows_.open(path) || !keys.open(path + ".keys")) {
+            throw std::runtime_error("--dedup-from needs " + path + " and " + path + ".keys");
+        }
+        EmbeddingFileHeader rows_header, keys_header;
+        if (previous_rows_.size() < sizeof(rows_header) || keys.size() < sizeof(keys_header)) {
+            throw std::runtime_error(path + ": truncated");
+        }
+        std::memcpy(&rows_header, previous_rows_.data(), sizeof(rows_header));
+        std::memcpy(&keys_header, keys.data(), sizeof(keys_header));
+        if (std::memcmp(rows_header.magic, "AEMB", 4) != 0 || std::memcmp(keys_header.magic, "AEMK", 4) != 0 ||
+            keys_header.count != rows_header.count ||
+            previous_rows_.size() < static_cast<size_t>(rowOffset(rows_header.count)) ||
+            keys.size() < sizeof(keys_header) + size_t(keys_header.count) * sizeof(RowKey)) {
+            throw std::runtime_error(path + " is not a complete bulk output with keys");
+        }
+        if (rows_header.dim != dim || rows_header.dtype != static_cast<uint8_t>(config_.dtype)) {
+            throw std::runtime_error(path + " holds " + std::to_string(rows_header.dim) + "-dim " +
+                                     (rows_header.dtype == static_cast<uint8_t>(VectorDtype::F16) ? "f16" : "f32") +
+                                     " rows; this run writes " + std::to_string(dim) + "-dim " +
+                                     (config_.dtype == VectorDtype::F16 ? "f16" : "f32"));
+        }
+        previous_.reserve(keys_header.count);
+        for (size_t r = 0; r < keys_header.count; ++r) {
+            RowKey key;
+            std::memcpy(&key, keys.data() + sizeof(keys_header) + r * sizeof(RowKey), sizeof(key));
+            previous_.emplace(key, r);
+        }
+    }
+
+    void pwriteFully(int fd, const char* data, size_t n, off_t offset) {
+        while (n > 0) {
+            ssize_t written = ::pwrite(fd, data, n, offset);
+            if (written < 0) {
+                if (errno == EINTR) continue;
+                throw std::runtime_error("write to " + config_.output_path + " failed: " + std::strerror(errno));
+            }
+            data += written;
+            offset += written;
+            n -= static_cast<size_t>(written);
+        }
+    }
 
-        auto ids_tensor = torch::from_blob(
-            const_cast<int64_t*>(input_ids.data()),
-            {1, static_cast<int64_t>(input_ids.size())},
-            torch::kLong
-        ).clone().to(device_);
+    void reportProgress(double seconds) const {
+        std::cerr << "bulk: " << rows_written_;
+        if (input_done_) {
+            size_t total = total_rows_;
+            std::cerr << "/" << total << " rows (" << std::fixed << std::setprecision(1)
+                      << (total ? 100.0 * rows_written_ / total : 100.0) << "%)";
+        } else {
+            std::cerr << " rows";
+        }
+        std::cerr << std::fixed << std::setprecision(1) << ", " << rows_written_ / seconds << " rows/s, "
+                  << std::setprecision(0) << tokens_written_ / seconds << " tokens/s" << std::defaultfloat << std::endl;
+    }
 
-        auto mask_tensor = torch::from_blob(
-            const_cast<int64_t*>(attention_mask.data()),
-            {1, static_cast<int64_t>(attention_mask.size())},
-            torch::kLong
-        ).clone().to(device_);
+public:
+    BulkEmbedder(const WordPieceTokenizer& tokenizer, ReplicaPool& pool, BulkConfig config)
+        : tokenizer_(tokenizer), pool_(pool), config_(std::move(config)), model_id_(pool.primary().modelId()),
+          batches_(pool.size() * 2) {}
 
-        std::vector<torch::jit::IValue> inputs;
-        inputs.push_back(ids_tensor);
-        inputs.push_back(mask_tensor);
+    int run() {
+        MappedFile input;
+        if (!input.open(config_.input_path)) {
+            std::cerr << "Cannot read " << config_.input_path << " (missing or empty)" << std::endl;
+            return 1;
+        }
+        const size_t dim = pool_.primary().dim();
+        row_bytes_ = dim * dtypeBytes(config_.dtype);
+        if (!config_.dedup_from.empty()) {
+            struct stat from_st, out_st;
+            if (::stat(config_.dedup_from.c_str(), &from_st) == 0 && ::stat(config_.output_path.c_str(), &out_st) == 0 &&
+                from_st.st_dev == out_st.st_dev && from_st.st_ino == out_st.st_ino) {
+                throw std::runtime_error("--dedup-from must not be the --output file");
+            }
+            loadPrevious(dim);
+        }
 
-        auto output_dict = model_.forward(inputs).toGenericDict();
-        auto last_hidden_state = output_dict.at("last_hidden_state").toTensor();
+        // The rows file is opened read-write: copies read rows back from it
+        const std::string keys_path = config_.output_path + ".keys";
+        int fd = ::open(config_.output_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        int keys_fd = fd < 0 ? -1 : ::open(keys_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0 || keys_fd < 0) {
+            std::cerr << "Cannot create " << (fd < 0 ? config_.output_path : keys_path) << ": "
+                      << std::strerror(errno) << std::endl;
+            if (fd >= 0) ::close(fd);
+            return 1;
+        }
 
-        // Mean pooling
-        auto pooled = last_hidden_state.mean(1).squeeze(0);
+        const auto start = std::chrono::steady_clock::now();
+        std::vector<std::thread> tokenizers, workers;
+        for (int t = 0; t < std::max(1, config_.tokenizer_threads); ++t) {
+            tokenizers.push_back(stage([this] { tokenizeLines(); }));
+        }
+        std::thread batcher = stage([this] { batchRows(); });
+        for (size_t r = 0; r < pool_.size(); ++r) {
+            workers.push_back(stage([this, r] { infer(r); }));
+        }
+        std::thread writer = stage([this, fd, keys_fd, dim] { writeRows(fd, keys_fd, dim); });
 
-        // L2 normalize
-        auto norm = pooled.norm(2);
-        auto normalized = pooled / norm;
+        // Each stage closes its output once all of its producers are done
+        try {
+            readLines(input);
+        } catch (...) {
+            fail(std::current_exception());
+        }
+        lines_.close();
+        for (auto& t : tokenizers) t.join();
+        rows_.close();
+        batcher.join();
+        batches_.close();
+        for (auto& t : workers) t.join();
+        results_.close();
+        writer.join();
 
-        auto cpu_tensor = normalized.to(torch::kCPU);
-        auto data_ptr = cpu_tensor.data_ptr<float>();
+        if (!error_ && rows_written_ != total_rows_) {
+            error_ = std::make_exception_ptr(std::runtime_error(
+                "wrote " + std::to_string(rows_written_) + " of " + std::to_string(total_rows_.load()) + " rows"));
+        }
+        if (!error_) {
+            // Headers last: files cut short by a failure never look complete
+            auto header = makeEmbeddingHeader(config_.dtype, rows_written_, dim);
+            auto keys_header = makeEmbeddingHeader(config_.dtype, rows_written_, dim);
+            std::memcpy(keys_header.magic, "AEMK", 4);
+            try {
+                pwriteFully(keys_fd, reinterpret_cast<const char*>(&keys_header), sizeof(keys_header), 0);
+                pwriteFully(fd, reinterpret_cast<const char*>(&header), sizeof(header), 0);
+            } catch (...) {
+                error_ = std::current_exception();
+            }
+        }
+        ::close(keys_fd);
+        ::close(fd);
+        if (error_) std::rethrow_exception(error_);
 
-        return std::vector<float>(data_ptr, data_ptr + cpu_tensor.numel());
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::cerr << "Bulk: " << rows_written_ << " rows, " << tokens_written_ << " tokens, " << batch_count_
+                  << " batches in " << std::fixed << std::setprecision(2) << seconds << " s" << std::endl;
+        std::cerr << "  " << std::setprecision(1) << rows_written_ / seconds << " rows/s, "
+                  << std::setprecision(0) << tokens_written_ / seconds << " tokens/s" << std::endl;
+        auto ratio = [&](uint64_t padded) { return real_tokens_ ? double(padded) / real_tokens_ : 1.0; };
+        std::cerr << "  padding ratio (padded / real tokens): " << std::setprecision(3)
+                  << ratio(input_order_padded_) << " in input order, " << ratio(padded_tokens_);
+        if (config_.sort_window > 0) {
+            std::cerr << " length-sorted (window " << config_.sort_window << " rows, "
+                      << std::setprecision(1)
+                      << (input_order_padded_ ? 100.0 * (1.0 - double(padded_tokens_) / input_order_padded_) : 0.0)
+                      << "% fewer padded tokens)";
+        } else {
+            std::cerr << " as run (--sort-window 0)";
+        }
+        std::cerr << std::defaultfloat << std::endl;
+        const size_t unique = rows_written_ - repeat_rows_ - reused_rows_;
+        const uint64_t all_tokens = real_tokens_ + skipped_tokens_;
+        std::cerr << "  dedup: " << unique << " of " << rows_written_ << " rows run through the model ("
+                  << std::fixed << std::setprecision(1) << (rows_written_ ? 100.0 * unique / rows_written_ : 100.0)
+                  << "% unique); " << repeat_rows_ << " repeats within the input";
+        if (!config_.dedup_from.empty()) std::cerr << ", " << reused_rows_ << " reused from " << config_.dedup_from;
+        std::cerr << std::endl;
+        std::cerr << "  compute saved: " << skipped_tokens_ << " of " << all_tokens << " tokens ("
+                  << (all_tokens ? 100.0 * skipped_tokens_ / all_tokens : 0.0) << "%) not run"
+                  << std::defaultfloat << std::endl;
+        std::cerr << "Wrote " << config_.output_path << ": " << rows_written_ << " x " << dim << " "
+                  << (config_.dtype == VectorDtype::F16 ? "f16" : "f32") << std::endl;
+        return 0;
     }
 };
 
@@ -213,41 +4668,471 @@ public:
 // Main
 // ============================================================================
 
+// Tracked CPU latency target, see FINAL_BENCHMARK.md ("CPU Target Tracking")
+static constexpr double kCpuBaselineMs = 29.85;
+
+// --bench-pool: SIMD pooling kernel vs the tensor-op sequence it replaces, on
+// random hidden states with ragged masks (no model needed)
+static int runPoolBenchmark(int64_t B, int64_t L, int64_t H) {
+    torch::manual_seed(0);
+    auto hidden = torch::randn({B, L, H});
+    auto lengths = torch::randint(1, L + 1, {B}, torch::kLong);
+    auto mask_tensor = (torch::arange(L).unsqueeze(0) < lengths.unsqueeze(1)).to(torch::kLong).contiguous();
+    const float* hidden_ptr = hidden.data_ptr<float>();
+    const int64_t* mask_ptr = mask_tensor.data_ptr<int64_t>();
+
+    auto tensorOps = [&]() {
+        c10::InferenceMode inference_mode;
+        auto mask = mask_tensor.unsqueeze(-1).to(hidden.scalar_type());
+        auto pooled = (hidden * mask).sum(1) / mask.sum(1).clamp_min(1e-9);
+        auto normalized = (pooled / pooled.norm(2, 1, true).clamp_min(1e-12)).contiguous();
+        return std::vector<float>(normalized.data_ptr<float>(), normalized.data_ptr<float>() + normalized.numel());
+    };
+    std::vector<float> out(static_cast<size_t>(B * H));
+    auto kernel = [&](PoolNormalizeFn fn) {
+        fn(hidden_ptr, mask_ptr, static_cast<size_t>(B), static_cast<size_t>(L), static_cast<size_t>(H), out.data());
+    };
+
+    auto timeUs = [](const std::function<void()>& body) {
+        for (int i = 0; i < 10; ++i) body();
+        const int iters = 200;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iters; ++i) body();
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0 / iters;
+    };
+
+    auto reference = tensorOps();
+    kernel(kPoolNormalize.fn);
+    float max_diff = 0.0f;
+    for (size_t i = 0; i < out.size(); ++i) max_diff = std::max(max_diff, std::fabs(out[i] - reference[i]));
+
+    double tensor_us = timeUs([&] { tensorOps(); });
+    double scalar_us = timeUs([&] { kernel(poolNormalizeScalar); });
+    double simd_us = timeUs([&] { kernel(kPoolNormalize.fn); });
+
+    std::cout << "Masked mean + L2 normalize, hidden [" << B << ", " << L << ", " << H << "] fp32" << std::endl;
+    std::cout << "  tensor ops:      " << tensor_us << " us" << std::endl;
+    std::cout << "  scalar kernel:   " << scalar_us << " us (" << tensor_us / scalar_us << "x)" << std::endl;
+    std::cout << "  " << kPoolNormalize.name << " kernel:" << std::string(std::max<int>(1, 9 - int(std::strlen(kPoolNormalize.name))), ' ')
+              << simd_us << " us (" << tensor_us / simd_us << "x)" << std::endl;
+    std::cout << "  max |diff| vs tensor ops: " << max_diff << std::endl;
+    return max_diff < 1e-5f ? 0 : 1;
+}
+
+// --bench-json: the shortest-round-trip JSON writer vs the iostream loop it
+// replaced (per-element `<< std::setprecision(8)`), on random unit vectors.
+// Also counts values that do not parse back to the same float.
+static int runJsonBenchmark(size_t count, size_t dim) {
+    std::mt19937 rng(0);
+    std::normal_distribution<float> normal;
+    std::vector<float> rows(count * dim);
+    for (size_t r = 0; r < count; ++r) {
+        float* row = rows.data() + r * dim;
+        double norm = 0.0;
+        for (size_t i = 0; i < dim; ++i) {
+            row[i] = normal(rng);
+            norm += double(row[i]) * row[i];
+        }
+        for (size_t i = 0; i < dim; ++i) row[i] = static_cast<float>(row[i] / std::sqrt(norm));
+    }
+
+    std::string stream_out;
+    auto streamLoop = [&] {
+        std::ostringstream os;
+        os << "[";
+        for (size_t r = 0; r < count; ++r) {
+            if (r > 0) os << ",";
+            os << "[";
+            for (size_t i = 0; i < dim; ++i) {
+                if (i > 0) os << ",";
+                os << std::setprecision(8) << rows[r * dim + i];
+            }
+            os << "]";
+        }
+        os << "]";
+        stream_out = os.str();
+    };
+    std::string writer_out;
+    auto writer = [&] {
+        writer_out.clear();
+        writer_out += '[';
+        for (size_t r = 0; r < count; ++r) {
+            if (r > 0) writer_out += ',';
+            appendEmbeddingJson(writer_out, rows.data() + r * dim, dim);
+        }
+        writer_out += ']';
+    };
+
+    // Values in a "[[a,b,...],[...]]" dump that do not read back bit-exact
+    auto roundTripMisses = [&](const std::string& text) {
+        size_t misses = 0, index = 0;
+        const char* p = text.c_str();
+        while (*p) {
+            if (*p == '[' || *p == ']' || *p == ',') {
+                ++p;
+                continue;
+            }
+            char* end;
+            float value = std::strtof(p, &end);
+            if (index >= rows.size() || std::memcmp(&value, &rows[index], sizeof(float)) != 0) ++misses;
+            ++index;
+            p = end;
+        }
+        return misses + (index != rows.size() ? rows.size() : 0);
+    };
+
+    auto timeUs = [](const std::function<void()>& body) {
+        for (int i = 0; i < 5; ++i) body();
+        const int iters = 50;
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iters; ++i) body();
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count() / 1000.0 / iters;
+    };
+    double stream_us = timeUs(streamLoop);
+    double writer_us = timeUs(writer);
+    size_t stream_misses = roundTripMisses(stream_out);
+    size_t writer_misses = roundTripMisses(writer_out);
+
+    std::cout << "JSON output, " << count << " vectors x " << dim << " floats" << std::endl;
+    std::cout << std::fixed << std::setprecision(2);
+    std::cout << "  iostream setprecision(8): " << stream_us / count << " us/vector, "
+              << double(stream_out.size()) / count << " bytes/vector, "
+              << stream_misses << " values not round-tripping" << std::endl;
+    std::cout << "  " << std::left << std::setw(26) << (std::string(kJsonFloatWriter) + ":") << std::right
+              << writer_us / count << " us/vector, "
+              << double(writer_out.size()) / count << " bytes/vector, "
+              << writer_misses << " values not round-tripping (" << stream_us / writer_us << "x)" << std::endl;
+    std::cout << std::defaultfloat;
+    return writer_misses == 0 ? 0 : 1;
+}
+
+// --bench-replicas: aggregate throughput of the batching scheduler over a
+// replicas x threads grid (powers of two within the available CPUs). Each
+// request gets distinct ids so the caches never short-circuit the model.
+static void runReplicaSweep(ArcticEmbedLibTorch& primary, const std::vector<int64_t>& ids, int requests,
+                            const SchedulerConfig& sched_config, int max_batch,
+                            const std::vector<NumaNode>& nodes) {
+    const auto cpus = availableCpus();
+    const int ncpu = static_cast<int>(cpus.size());
+    std::cout << "Replica sweep: " << requests << " requests x " << ids.size() << " tokens, "
+              << ncpu << " CPUs (" << formatCpuList(cpus) << ")";
+    if (nodes.size() > 1) std::cout << ", " << nodes.size() << " NUMA nodes";
+    std::cout << std::endl;
+
+    uint64_t salt = 0;
+    auto runRequests = [&](BatchScheduler& scheduler, int count) {
+        std::mutex done_mutex;
+        std::condition_variable done_cv;
+        int done = 0;
+        for (int i = 0; i < count; ++i) {
+            std::vector<int64_t> request = ids;
+            if (request.size() > 2) request[1] = 1000 + static_cast<int64_t>(salt++ % 28000);
+            scheduler.submit(std::move(request), [&](const float*, size_t, const char*) {
+                std::lock_guard<std::mutex> lock(done_mutex);
+                if (++done == count) done_cv.notify_one();
+            });
+        }
+        std::unique_lock<std::mutex> lock(done_mutex);
+        done_cv.wait(lock, [&] { return done == count; });
+    };
+
+    double best_tps = 0.0;
+    std::string best;
+    for (int threads = 1; threads <= ncpu; threads *= 2) {
+        for (int count = 1; count * threads <= ncpu; count *= 2) {
+            ReplicaPool pool(primary, count, threads, max_batch, cpus, nodes);
+            BatchScheduler scheduler(pool, sched_config);
+            runRequests(scheduler, std::max(8, count * 8));   // spin up per-replica thread pools
+
+            auto start = std::chrono::high_resolution_clock::now();
+            runRequests(scheduler, requests);
+            auto end = std::chrono::high_resolution_clock::now();
+            scheduler.stop();
+
+            double seconds = std::chrono::duration<double>(end - start).count();
+            double tps = requests / seconds;
+            std::string label = std::to_string(count) + " x " + std::to_string(threads);
+            std::cout << "  " << std::setw(9) << label << " (replicas x threads): "
+                      << std::fixed << std::setprecision(1) << tps << " texts/s" << std::defaultfloat << std::endl;
+            if (tps > best_tps) {
+                best_tps = tps;
+                best = label;
+            }
+        }
+    }
+    std::cout << "BEST SPLIT: " << best << " (" << std::fixed << std::setprecision(1) << best_tps
+              << " texts/s)" << std::defaultfloat << std::endl;
+}
+
+// Fixed corpus for reduced-precision quality checks (cosine vs fp32): short
+// and long sentences, code, numbers, punctuation-heavy and non-English text
+static const char* const kQualityCorpus[] = {
+    "OpenClaw is an AI assistant framework",
+    "Hello world",
+    "The quick brown fox jumps over the lazy dog",
+    "Machine learning is a subset of artificial intelligence",
+    "Remember that the user prefers dark mode and vim keybindings.",
+    "Meeting moved to Thursday 3:30pm, room 4B; bring the Q3 revenue numbers (~$1.2M).",
+    "fn main() { let v: Vec<u32> = (0..10).map(|x| x * x).collect(); println!(\"{:?}\", v); }",
+    "SELECT id, name FROM users WHERE created_at > NOW() - INTERVAL '7 days' ORDER BY name;",
+    "Error: ECONNREFUSED 127.0.0.1:5432 - is the database running?",
+    "The mitochondria is the powerhouse of the cell, producing ATP through oxidative phosphorylation.",
+    "I'm allergic to peanuts and shellfish, please keep that in mind when suggesting recipes.",
+    "Café, naïve, résumé, and coöperate keep their diacritics in French-derived English words.",
+    "안녕하세요, 오늘 날씨가 좋네요.",
+    "東京は日本の首都です。",
+    "Wait... what?! No way -- that's (almost) impossible!!!",
+    "1 2 3 4 5 6 7 8 9 10 11 12 13 14 15 16",
+    "Long-term memory lets the assistant recall preferences, facts and decisions across sessions, "
+    "so the user does not have to repeat context. Memories are embedded into 384-dimensional vectors "
+    "and stored in LanceDB, where recall is a nearest-neighbour search over L2 distance.",
+    "The project uses LibTorch with Metal Performance Shaders on Apple Silicon and falls back to the "
+    "CPU elsewhere; the tokenizer is a BERT-compatible WordPiece implementation written in C++.",
+};
+
+// Benchmark-mode companion for --precision: loads the fp32 model on the same
+// device/threads, reports the latency gain and how far the candidate's
+// vectors drift from fp32 over kQualityCorpus.
+static void reportPrecisionQuality(const std::string& model_path, EngineConfig config,
+                                   const WordPieceTokenizer& tokenizer, ArcticEmbedLibTorch& candidate,
+                                   const std::vector<int64_t>& input_ids, const std::vector<int64_t>& attention_mask,
+                                   double candidate_ms) {
+    config.precision = Precision::FP32;
+    config.device = candidate.device().is_cpu() ? "cpu" : "mps";
+    config.interop_threads = 0;              // pool is already running
+    config.cache_bytes = 0;
+    config.disk_cache_path.clear();
+    // Never the candidate's own file: an int8 artifact passed directly would
+    // compare against itself
+    const std::string reference_path = ArcticEmbedLibTorch::referenceModelPath(model_path);
+    if (reference_path.empty()) {
+        std::cout << "PRECISION: no fp32 model found for " << model_path
+                  << "; skipping the comparison (pass the fp32 model with --precision instead)" << std::endl;
+        return;
+    }
+    ArcticEmbedLibTorch reference(reference_path, true, config);
+
+    for (int i = 0; i < 20; ++i) reference.embed(input_ids, attention_mask);
+    const int iters = 200;
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iters; ++i) reference.embed(input_ids, attention_mask);
+    auto end = std::chrono::high_resolution_clock::now();
+    double reference_ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0 / iters;
+
+    double sum_cos = 0.0, min_cos = 1.0;
+    size_t n = 0;
+    for (const char* text : kQualityCorpus) {
+        auto [ids, mask] = tokenizer.tokenize(text);
+        auto a = reference.embed(ids, mask);
+        auto b = candidate.embed(ids, mask);
+        double dot = 0.0, na = 0.0, nb = 0.0;
+        for (size_t d = 0; d < a.size() && d < b.size(); ++d) {
+            dot += double(a[d]) * b[d];
+            na += double(a[d]) * a[d];
+            nb += double(b[d]) * b[d];
+        }
+        double cos = dot / std::max(1e-12, std::sqrt(na * nb));
+        sum_cos += cos;
+        min_cos = std::min(min_cos, cos);
+        ++n;
+    }
+
+    std::cout << "PRECISION: " << precisionName(candidate.precision()) << " vs fp32 (same device and threads)" << std::endl;
+    std::cout << "FP32 LATENCY: " << reference_ms << " ms -> SPEEDUP: " << reference_ms / candidate_ms << "x" << std::endl;
+    std::cout << "COSINE vs FP32 (" << n << " texts): mean " << std::setprecision(6) << sum_cos / n
+              << ", min " << min_cos << " (max deviation " << 1.0 - min_cos << ")" << std::defaultfloat << std::endl;
+}
+
 int main(int argc, char* argv[]) {
-    if (argc < 3) {
-        std::cerr << "Usage: " << argv[0] << " <model_path> <input_text> [--json] [--vocab <path>]" << std::endl;
+    // Offline step: vocab.txt -> mmap-able image (no model needed)
+    if (argc >= 2 && std::string(argv[1]) == "--compile-vocab") {
+        if (argc < 4) {
+            std::cerr << "Usage: " << argv[0] << " --compile-vocab <vocab.txt> <vocab.bin>" << std::endl;
+            return 1;
+        }
+        WordPieceTokenizer tokenizer;
+        if (!tokenizer.load(argv[2])) {
+            std::cerr << "Failed to load vocab from: " << argv[2] << std::endl;
+            return 1;
+        }
+        if (!tokenizer.saveImage(argv[3])) {
+            std::cerr << "Failed to write vocab image: " << argv[3] << std::endl;
+            return 1;
+        }
+        std::cerr << "Compiled " << tokenizer.vocabSize() << " tokens -> " << argv[3] << std::endl;
+        return 0;
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench-json") {
+        size_t count = argc > 2 ? static_cast<size_t>(std::max(1, std::atoi(argv[2]))) : 1000;
+        return runJsonBenchmark(count, 384);
+    }
+
+    if (argc >= 2 && std::string(argv[1]) == "--bench-pool") {
+        int64_t B = argc > 2 ? std::max(1, std::atoi(argv[2])) : 32;
+        int64_t L = argc > 3 ? std::max(1, std::atoi(argv[3])) : 128;
+        return runPoolBenchmark(B, L, 384);
+    }
+
+    if (argc < 2) {
+        std::cerr << "Usage: " << argv[0] << " <model_path> <input_text> [--json | --format json|f32le|f16le|base64-f32] [--vocab <path>] [--bench-batch <n>]" << std::endl;
+        std::cerr << "       " << argv[0] << " --compile-vocab <vocab.txt> <vocab.bin>" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-pool [batch] [seq_len]" << std::endl;
+        std::cerr << "       " << argv[0] << " --bench-json [vectors]" << std::endl;
+        std::cerr << "  common: [--device cpu|mps|auto] [--precision fp32|int8|bf16|fp16] [--optimize] [--threads <n>] [--interop-threads <n>] [--cache-mb <n>]"
+                  << " [--disk-cache <file>] [--disk-cache-mb <n>]" << std::endl;
+        std::cerr << "  chunking: [--chunk] [--chunk-tokens <n>] [--chunk-overlap <n>] [--chunk-pool mean|max]"
+                  << " [--chunk-vectors]" << std::endl;
+        std::cerr << "       " << argv[0] << " <model_path> --serve|--listen <socket> [--vocab <path>]"
+                  << " [--buckets 16,32,...] [--max-batch-tokens <n>] [--max-wait-ms <ms>] [--max-queued-rows <n>]"
+                  << " [--replicas <n>] [--replica-threads <n>] [--no-numa] [--listen-max-in-flight <n>]" << std::endl;
+        std::cerr << "       " << argv[0] << " <model_path> --input <texts.jsonl> --output <out.bin> [--format f32le|f16le]"
+                  << " [--tokenizer-threads <n>] [--sort-window <rows>] [--max-batch-tokens <n>] [--replicas <n>]"
+                  << " [--no-dedup] [--dedup-from <prev.bin>]" << std::endl;
+        std::cerr << "  benchmark: [--bench-batch <n>] [--bench-replicas <requests>]" << std::endl;
         return 1;
     }
 
     std::string model_path = argv[1];
-    std::string input_text = argv[2];
+    std::string input_text;
+    bool have_text = false;
 
     bool json_mode = false;
+    std::string format_name = "json";
+    bool serve_mode = false;
+    int bench_batch = 32;
+    SchedulerConfig sched_config;
+    EngineConfig engine_config;
+    ChunkConfig chunk_config;
+    bool chunk_mode = false;
     std::string vocab_path;
+    std::string precision_name = "fp32";
+    int replicas = 1;
+    int replica_threads = 0;
+    int sweep_requests = 0;
+    bool numa = true;
+    std::string listen_path;
+    size_t listen_max_in_flight = kSocketDefaultMaxInFlight;
+    BulkConfig bulk_config;
 
-    // Parse optional flags
-    for (int i = 3; i < argc; ++i) {
+    // Parse input text + optional flags
+    for (int i = 2; i < argc; ++i) {
         std::string arg = argv[i];
         if (arg == "--json") {
             json_mode = true;
+        } else if (arg == "--serve") {
+            serve_mode = true;
         } else if (arg == "--vocab" && i + 1 < argc) {
             vocab_path = argv[++i];
+        } else if (arg == "--device" && i + 1 < argc) {
+            engine_config.device = argv[++i];
+        } else if (arg == "--precision" && i + 1 < argc) {
+            precision_name = argv[++i];
+        } else if (arg == "--optimize") {
+            engine_config.optimize = true;
+        } else if (arg == "--threads" && i + 1 < argc) {
+            engine_config.num_threads = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--interop-threads" && i + 1 < argc) {
+            engine_config.interop_threads = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--cache-mb" && i + 1 < argc) {
+            engine_config.cache_bytes = static_cast<size_t>(std::max(0.0, std::atof(argv[++i])) * 1024 * 1024);
+        } else if (arg == "--disk-cache" && i + 1 < argc) {
+            engine_config.disk_cache_path = argv[++i];
+        } else if (arg == "--disk-cache-mb" && i + 1 < argc) {
+            engine_config.disk_cache_bytes = static_cast<size_t>(std::max(1.0, std::atof(argv[++i])) * 1024 * 1024);
+        } else if (arg == "--chunk") {
+            chunk_mode = true;
+        } else if (arg == "--chunk-tokens" && i + 1 < argc) {
+            chunk_config.window_tokens = std::atoi(argv[++i]);
+        } else if (arg == "--chunk-overlap" && i + 1 < argc) {
+            chunk_config.overlap_tokens = std::atoi(argv[++i]);
+        } else if (arg == "--chunk-pool" && i + 1 < argc) {
+            std::string pool = argv[++i];
+            chunk_config.pooling = pool == "max" ? ChunkPooling::Max : ChunkPooling::Mean;
+        } else if (arg == "--chunk-vectors") {
+            chunk_mode = true;
+            chunk_config.return_chunks = true;
+        } else if (arg == "--buckets" && i + 1 < argc) {
+            sched_config.bucket_bounds.clear();
+            std::stringstream list(argv[++i]);
+            std::string bound;
+            while (std::getline(list, bound, ',')) {
+                if (!bound.empty()) sched_config.bucket_bounds.push_back(std::stoll(bound));
+            }
+        } else if (arg == "--max-batch-tokens" && i + 1 < argc) {
+            sched_config.max_batch_tokens = std::max(1LL, std::atoll(argv[++i]));
+        } else if (arg == "--max-wait-ms" && i + 1 < argc) {
+            sched_config.max_wait = std::chrono::microseconds(
+                static_cast<int64_t>(std::max(0.0, std::atof(argv[++i])) * 1000.0));
+        } else if (arg == "--replicas" && i + 1 < argc) {
+            replicas = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--replica-threads" && i + 1 < argc) {
+            replica_threads = std::max(0, std::atoi(argv[++i]));
+        } else if (arg == "--format" && i + 1 < argc) {
+            format_name = argv[++i];
+            json_mode = true;
+        } else if (arg == "--input" && i + 1 < argc) {
+            bulk_config.input_path = argv[++i];
+        } else if (arg == "--output" && i + 1 < argc) {
+            bulk_config.output_path = argv[++i];
+        } else if (arg == "--dedup-from" && i + 1 < argc) {
+            bulk_config.dedup_from = argv[++i];
+        } else if (arg == "--no-dedup") {
+            bulk_config.dedup = false;
+        } else if (arg == "--sort-window" && i + 1 < argc) {
+            bulk_config.sort_window = static_cast<size_t>(std::max(0, std::atoi(argv[++i])));
+        } else if (arg == "--tokenizer-threads" && i + 1 < argc) {
+            bulk_config.tokenizer_threads = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--listen" && i + 1 < argc) {
+            listen_path = argv[++i];
+            serve_mode = true;
+        } else if (arg == "--listen-max-in-flight" && i + 1 < argc) {
+            listen_max_in_flight = static_cast<size_t>(std::max(1, std::atoi(argv[++i])));
+        } else if (arg == "--max-queued-rows" && i + 1 < argc) {
+            sched_config.max_queued_rows = static_cast<size_t>(std::max(1LL, std::atoll(argv[++i])));
+        } else if (arg == "--no-numa") {
+            numa = false;
+        } else if (arg == "--bench-replicas" && i + 1 < argc) {
+            sweep_requests = std::max(1, std::atoi(argv[++i]));
+        } else if (arg == "--bench-batch" && i + 1 < argc) {
+            bench_batch = std::max(1, std::atoi(argv[++i]));
+        } else if (!have_text) {
+            input_text = arg;
+            have_text = true;
         }
     }
 
-    // Auto-detect vocab path if not specified
+    const bool bulk_mode = !bulk_config.input_path.empty();
+    if (bulk_mode && bulk_config.output_path.empty()) {
+        std::cerr << "--input needs --output <file>" << std::endl;
+        return 1;
+    }
+    if (!have_text && !serve_mode && !bulk_mode) {
+        std::cerr << "Missing <input_text> (or use --serve / --input)" << std::endl;
+        return 1;
+    }
+
+    // Auto-detect vocab path if not specified: prefer the compiled image
     if (vocab_path.empty()) {
         // Try relative to binary location
         std::string binary_path = argv[0];
         auto last_slash = binary_path.rfind('/');
-        if (last_slash != std::string::npos) {
-            vocab_path = binary_path.substr(0, last_slash) + "/vocab.txt";
+        std::string bin_dir = last_slash != std::string::npos ? binary_path.substr(0, last_slash) : "bin";
+
+        struct stat st;
+        if (stat((bin_dir + "/vocab.bin").c_str(), &st) == 0) {
+            vocab_path = bin_dir + "/vocab.bin";
         } else {
-            vocab_path = "bin/vocab.txt";
+            vocab_path = bin_dir + "/vocab.txt";
         }
     }
 
     try {
+        engine_config.precision = parsePrecision(precision_name);
+        const OutputFormat output_format = parseOutputFormat(format_name);
+
         // Load tokenizer
         WordPieceTokenizer tokenizer;
         if (!tokenizer.load(vocab_path)) {
@@ -255,24 +5140,106 @@ int main(int argc, char* argv[]) {
             return 1;
         }
 
+        if (bulk_mode) {
+            // Bulk mode: JSONL in, embedding matrix out (--format f32le|f16le)
+            if (format_name == "json" || output_format == OutputFormat::F32LE) {
+                bulk_config.dtype = VectorDtype::F32;
+            } else if (output_format == OutputFormat::F16LE) {
+                bulk_config.dtype = VectorDtype::F16;
+            } else {
+                throw std::invalid_argument("bulk output supports --format f32le or f16le");
+            }
+            bulk_config.max_batch_tokens = sched_config.max_batch_tokens;
+            engine_config.max_batch = static_cast<int>(std::max<long long>(1, (sched_config.max_batch_tokens + 511) / 512));
+            ArcticEmbedLibTorch embedder(model_path, true, engine_config);
+
+            auto [warm_ids, warm_mask] = tokenizer.tokenize("warmup");
+            embedder.embed(warm_ids, warm_mask);
+
+            std::unique_ptr<ReplicaPool> pool = replicas > 1
+                ? std::make_unique<ReplicaPool>(embedder, replicas, replica_threads, engine_config.max_batch,
+                                                std::vector<int>{}, numa ? detectNumaNodes() : std::vector<NumaNode>{})
+                : std::make_unique<ReplicaPool>(embedder);
+            BulkEmbedder bulk(tokenizer, *pool, bulk_config);
+            return bulk.run();
+        }
+
+        if (serve_mode) {
+            // Server mode: load once, answer requests until stdin closes.
+            // Staging sized for the scheduler's padded-token budget.
+            engine_config.max_batch = static_cast<int>(std::max<long long>(1, (sched_config.max_batch_tokens + 511) / 512));
+            ArcticEmbedLibTorch embedder(model_path, true, engine_config);
+
+            auto [warm_ids, warm_mask] = tokenizer.tokenize("warmup");
+            embedder.embed(warm_ids, warm_mask);
+
+            std::unique_ptr<ReplicaPool> pool = replicas > 1
+                ? std::make_unique<ReplicaPool>(embedder, replicas, replica_threads, engine_config.max_batch,
+                                                std::vector<int>{}, numa ? detectNumaNodes() : std::vector<NumaNode>{})
+                : std::make_unique<ReplicaPool>(embedder);
+            BatchScheduler scheduler(*pool, sched_config);
+            if (!listen_path.empty()) {
+                return runSocketServer(tokenizer, scheduler, chunk_config, listen_path, listen_max_in_flight);
+            }
+            return runServer(tokenizer, scheduler, chunk_config);
+        }
+
         auto [input_ids, attention_mask] = tokenizer.tokenize(input_text);
 
-        if (json_mode) {
+        // One-shot JSON with a shared disk cache: answer repeat texts without
+        // loading the model at all
+        if (json_mode && !engine_config.disk_cache_path.empty()) {
+            DiskEmbeddingCache disk_cache;
+            if (disk_cache.open(engine_config.disk_cache_path, engine_config.disk_cache_bytes)) {
+                uint64_t model_id = ArcticEmbedLibTorch::modelIdentity(model_path, engine_config);
+                const size_t dim = disk_cache.dim();
+
+                if (chunk_mode) {
+                    std::vector<std::vector<int64_t>> windows;
+                    tokenizer.chunkInto(input_text, chunk_config, windows);
+                    ChunkedEmbedding result;
+                    result.chunks.resize(windows.size() * dim);
+                    bool all_hit = true;
+                    for (size_t w = 0; w < windows.size() && all_hit; ++w) {
+                        all_hit = disk_cache.lookup(windows[w], model_id, result.chunks.data() + w * dim);
+                        result.chunk_tokens.push_back(windows[w].size());
+                    }
+                    if (all_hit) {
+                        result.document.resize(dim);
+                        aggregateChunks(result.chunks.data(), result.chunk_tokens, dim, chunk_config.pooling,
+                                        result.document.data());
+                        writeOneShot(output_format, result, chunk_config.return_chunks);
+                        return 0;
+                    }
+                } else {
+                    std::vector<float> embedding(dim);
+                    if (disk_cache.lookup(input_ids, model_id, embedding.data())) {
+                        writeOneShot(output_format, embedding.data(), dim);
+                        return 0;
+                    }
+                }
+            }
+        }
+
+        if (json_mode && chunk_mode) {
+            // Chunked JSON mode: whole document, pooled over windows
+            ArcticEmbedLibTorch embedder(model_path, true, engine_config);
+            embedder.embed(input_ids, attention_mask);
+
+            auto result = embedDocument(tokenizer, embedder, input_text, chunk_config);
+            writeOneShot(output_format, result, chunk_config.return_chunks);
+        } else if (json_mode) {
             // JSON mode: output embedding array and exit
-            ArcticEmbedLibTorch embedder(model_path, true);
+            ArcticEmbedLibTorch embedder(model_path, true, engine_config);
 
             // One warmup run
             embedder.embed(input_ids, attention_mask);
 
             auto embedding = embedder.embed(input_ids, attention_mask);
+            embedder.storeCached(input_ids, embedding.data(), embedding.size());
 
-            // Output as JSON array
-            std::cout << "[";
-            for (size_t i = 0; i < embedding.size(); ++i) {
-                if (i > 0) std::cout << ",";
-                std::cout << std::setprecision(8) << embedding[i];
-            }
-            std::cout << "]" << std::endl;
+            // JSON array, or a binary form with --format
+            writeOneShot(output_format, embedding.data(), embedding.size());
 
             std::this_thread::sleep_for(std::chrono::milliseconds(5));
         } else {
@@ -282,8 +5249,20 @@ int main(int argc, char* argv[]) {
             std::cout << "==================================================" << std::endl;
             std::cout << std::endl;
 
-            ArcticEmbedLibTorch embedder(model_path, false);
+            engine_config.max_batch = std::max(engine_config.max_batch, bench_batch);
+            // Every timed call repeats one text: with a cache it would time lookups
+            if (engine_config.cache_bytes > 0 || !engine_config.disk_cache_path.empty()) {
+                std::cerr << "Note: --cache-mb/--disk-cache are ignored in benchmark mode" << std::endl;
+                engine_config.cache_bytes = 0;
+                engine_config.disk_cache_path.clear();
+            }
+            ArcticEmbedLibTorch embedder(model_path, false, engine_config);
+            bool on_cpu = embedder.device().is_cpu();
 
+            std::cout << "Device: " << (on_cpu ? "CPU" : "MPS");
+            if (on_cpu) std::cout << " (" << torch::get_num_threads() << " threads)";
+            std::cout << ", precision " << precisionName(embedder.precision())
+                      << (embedder.fused() ? ", fused export" : "") << std::endl;
             std::cout << "Tokens: " << input_ids.size() << std::endl;
             std::cout << "Running benchmark (1000 iterations)..." << std::endl;
 
@@ -299,12 +5278,43 @@ int main(int argc, char* argv[]) {
             double total_ms = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count() / 1000.0;
             double avg_ms = total_ms / 1000.0;
 
+            // Batched throughput (same text repeated, so no padding)
+            std::vector<std::vector<int64_t>> batch(bench_batch, input_ids);
+            for (int i = 0; i < 5; ++i) embedder.embedBatch(batch);
+
+            const int batch_iters = 50;
+            auto batch_start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < batch_iters; ++i) {
+                embedder.embedBatch(batch);
+            }
+            auto batch_end = std::chrono::high_resolution_clock::now();
+
+            double batch_ms = std::chrono::duration_cast<std::chrono::microseconds>(batch_end - batch_start).count() / 1000.0;
+            double single_tps = 1000.0 / avg_ms;
+            double batch_tps = batch_iters * bench_batch * 1000.0 / batch_ms;
+
             auto embedding = embedder.embed(input_ids, attention_mask);
             std::cout << "\nEmbedding dim: " << embedding.size() << std::endl;
             std::cout << "==================================================" << std::endl;
             std::cout << "PURE INFERENCE LATENCY: " << avg_ms << " ms" << std::endl;
+            if (on_cpu) {
+                std::cout << "CPU TARGET: " << avg_ms << " ms vs " << kCpuBaselineMs
+                          << " ms baseline (" << kCpuBaselineMs / avg_ms << "x)" << std::endl;
+            }
+            std::cout << "THROUGHPUT (batch=1):  " << single_tps << " texts/s" << std::endl;
+            std::cout << "THROUGHPUT (batch=" << bench_batch << "): " << batch_tps << " texts/s ("
+                      << batch_tps / single_tps << "x)" << std::endl;
+            if (embedder.precision() != Precision::FP32) {
+                reportPrecisionQuality(model_path, engine_config, tokenizer, embedder,
+                                       input_ids, attention_mask, avg_ms);
+            }
             std::cout << "==================================================" << std::endl;
 
+            if (sweep_requests > 0) {
+                runReplicaSweep(embedder, input_ids, sweep_requests, sched_config, engine_config.max_batch,
+                                numa ? detectNumaNodes() : std::vector<NumaNode>{});
+            }
+
             std::this_thread::sleep_for(std::chrono::milliseconds(10));
         }
 